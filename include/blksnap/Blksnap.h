@@ -81,6 +81,13 @@ namespace blksnap
 #ifdef BLK_SNAP_MODIFICATION
         /* Additional functional */
         bool Modification(struct blk_snap_mod& mod);
+        void AppendDiffStorageFile(const uuid_t& id, int fd, unsigned long long sectorCount);
+        void GetStorageStat(const uuid_t& id, struct blk_snap_snapshot_storage_stat& stat);
+        void GetStorageUsage(const uuid_t& id, struct blk_snap_snapshot_storage_usage& usage,
+                             std::vector<struct blk_snap_storage_dev_usage>& storageDevices,
+                             std::vector<struct blk_snap_orig_dev_usage>& originalDevices);
+        int OpenEventFd(const uuid_t& id);
+        static bool ReadEvent(int eventFd, SBlksnapEvent& ev);
 #    ifdef BLK_SNAP_DEBUG_SECTOR_STATE
         void GetSectorState(struct blk_snap_dev image_dev_id, off_t offset, struct blk_snap_sector_state& state);
 #    endif
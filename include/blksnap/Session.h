@@ -28,6 +28,38 @@
 
 namespace blksnap
 {
+    struct SStorageDeviceUsage
+    {
+        unsigned int major;
+        unsigned int minor;
+        sector_t capacity;
+        sector_t filled;
+        sector_t wasted;
+    };
+
+    struct SOriginalDeviceUsage
+    {
+        std::string device;
+        sector_t stored;
+        unsigned long long regionCount;
+    };
+
+    /*
+     * The usage of the difference storage of the snapshot. The filled
+     * sectors include the wasted ones, that were left unused at the ends
+     * of the appended ranges.
+     */
+    struct SStorageUsage
+    {
+        sector_t capacity;
+        sector_t filled;
+        sector_t requested;
+        sector_t wasted;
+        unsigned long long regionCount;
+        std::vector<SStorageDeviceUsage> storageDevices;
+        std::vector<SOriginalDeviceUsage> originalDevices;
+    };
+
     struct ISession
     {
         virtual ~ISession(){};
@@ -35,6 +67,7 @@ namespace blksnap
         virtual std::string GetImageDevice(const std::string& original) = 0;
         virtual std::string GetOriginalDevice(const std::string& image) = 0;
         virtual bool GetError(std::string& errorMessage) = 0;
+        virtual void GetStorageUsage(SStorageUsage& usage) = 0;
 
         // TODO: add limits
         static std::shared_ptr<ISession> Create(const std::vector<std::string>& devices,
@@ -63,6 +63,63 @@ bool CBlksnap::Modification(struct blk_snap_mod& mod)
     }
     return true;
 }
+
+void CBlksnap::AppendDiffStorageFile(const uuid_t& id, int fd, unsigned long long sectorCount)
+{
+    struct blk_snap_snapshot_append_file param = {0};
+
+    uuid_copy(param.id.b, id);
+    param.sector_count = sectorCount;
+    param.fd = fd;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_APPEND_FILE, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to append file to diff storage for snapshot.");
+}
+
+void CBlksnap::GetStorageStat(const uuid_t& id, struct blk_snap_snapshot_storage_stat& stat)
+{
+    struct blk_snap_snapshot_storage_stat param = {0};
+
+    uuid_copy(param.id.b, id);
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_STAT, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get diff storage statistics.");
+
+    stat = param;
+}
+
+void CBlksnap::GetStorageUsage(const uuid_t& id, struct blk_snap_snapshot_storage_usage& usage,
+                               std::vector<struct blk_snap_storage_dev_usage>& storageDevices,
+                               std::vector<struct blk_snap_orig_dev_usage>& originalDevices)
+{
+    struct blk_snap_snapshot_storage_usage param = {0};
+
+    uuid_copy(param.id.b, id);
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_USAGE, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get diff storage usage.");
+
+    /*
+     * The block devices can be appended to the diff storage between the
+     * calls. In this case, the kernel module returns the new number of
+     * the devices.
+     */
+    while (true)
+    {
+        storageDevices.resize(param.storage_dev_count);
+        param.storage_dev_array = storageDevices.data();
+        originalDevices.resize(param.orig_dev_count);
+        param.orig_dev_array = originalDevices.data();
+
+        if (!::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_USAGE, &param))
+            break;
+
+        if (errno != ENODATA)
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get diff storage usage.");
+    }
+
+    usage = param;
+}
 #endif
 
 void CBlksnap::CollectTrackers(std::vector<struct blk_snap_cbt_info>& cbtInfoVector)
@@ -164,20 +221,8 @@ void CBlksnap::Take(const uuid_t& id)
         throw std::system_error(errno, std::generic_category(), "[TBD]Failed to take snapshot.");
 }
 
-bool CBlksnap::WaitEvent(const uuid_t& id, unsigned int timeoutMs, SBlksnapEvent& ev)
+static void fillEvent(const struct blk_snap_snapshot_event& param, SBlksnapEvent& ev)
 {
-    struct blk_snap_snapshot_event param;
-
-    uuid_copy(param.id.b, id);
-    param.timeout_ms = timeoutMs;
-
-    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENT, &param))
-    {
-        if ((errno == ENOENT) || (errno == EINTR))
-            return false;
-        else
-            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get event from snapshot.");
-    }
     ev.code = param.code;
     ev.time = param.time_label;
 
@@ -199,8 +244,67 @@ bool CBlksnap::WaitEvent(const uuid_t& id, unsigned int timeoutMs, SBlksnapEvent
         break;
     }
     }
+}
+
+bool CBlksnap::WaitEvent(const uuid_t& id, unsigned int timeoutMs, SBlksnapEvent& ev)
+{
+    struct blk_snap_snapshot_event param;
+
+    uuid_copy(param.id.b, id);
+    param.timeout_ms = timeoutMs;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENT, &param))
+    {
+        if ((errno == ENOENT) || (errno == EINTR))
+            return false;
+        else
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get event from snapshot.");
+    }
+    fillEvent(param, ev);
+    return true;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * The file descriptor can be polled together with the descriptors of other
+ * snapshots. It should be closed by the caller.
+ */
+int CBlksnap::OpenEventFd(const uuid_t& id)
+{
+    struct blk_snap_snapshot_event_fd param = {0};
+
+    uuid_copy(param.id.b, id);
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to open event file for snapshot.");
+
+    return param.fd;
+}
+
+/*
+ * Reads one event from the file descriptor of the snapshot events. Returns
+ * false if the non-blocking descriptor has no events. The end of the file
+ * means that the snapshot has been destroyed.
+ */
+bool CBlksnap::ReadEvent(int eventFd, SBlksnapEvent& ev)
+{
+    struct blk_snap_snapshot_event param;
+    ssize_t ret;
+
+    ret = ::read(eventFd, &param, sizeof(param));
+    if (ret == 0)
+        throw std::system_error(ESRCH, std::generic_category(), "[TBD]Snapshot has been destroyed.");
+    if (ret != sizeof(param))
+    {
+        if ((errno == EAGAIN) || (errno == EINTR))
+            return false;
+        else
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to read event from snapshot.");
+    }
+    fillEvent(param, ev);
     return true;
 }
+#endif
 
 #if defined(BLK_SNAP_MODIFICATION) && defined(BLK_SNAP_DEBUG_SECTOR_STATE)
 void CBlksnap::GetSectorState(struct blk_snap_dev image_dev_id, off_t offset, struct blk_snap_sector_state& state)
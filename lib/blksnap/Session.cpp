@@ -27,8 +27,10 @@
 #include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <mutex>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
@@ -72,6 +74,14 @@ struct SState
     int diffDeviceMajor;
     int diffDeviceMinor;
     SRangeVectorPos diffStoragePosition;
+
+    /*
+     * If the module supports the file descriptor of the snapshot events,
+     * the thread polls it together with the descriptor that is signaled
+     * when the thread should stop.
+     */
+    int eventFd;
+    int stopFd;
 };
 
 class CSession : public ISession
@@ -83,6 +93,7 @@ public:
     std::string GetImageDevice(const std::string& original) override;
     std::string GetOriginalDevice(const std::string& image) override;
     bool GetError(std::string& errorMessage) override;
+    void GetStorageUsage(SStorageUsage& usage) override;
 
 private:
     uuid_t m_id;
@@ -219,6 +230,101 @@ namespace
         ::close(fd);
     }
 
+    static bool IsAppendFileSupported(CBlksnap& blksnap)
+    {
+#ifdef BLK_SNAP_MODIFICATION
+        struct blk_snap_mod mod;
+
+        if (blksnap.Modification(mod))
+            return (mod.compatibility_flags & (1ull << blk_snap_compat_flag_append_file)) != 0;
+#endif
+        return false;
+    }
+
+    static bool IsEventFdSupported(CBlksnap& blksnap)
+    {
+#ifdef BLK_SNAP_MODIFICATION
+        struct blk_snap_mod mod;
+
+        if (blksnap.Modification(mod))
+            return (mod.compatibility_flags & (1ull << blk_snap_compat_flag_event_fd)) != 0;
+#endif
+        return false;
+    }
+
+    static void OpenEventFd(CBlksnap& blksnap, std::shared_ptr<SState> ptrState)
+    {
+        ptrState->eventFd = blksnap.OpenEventFd(ptrState->id);
+
+        int flags = ::fcntl(ptrState->eventFd, F_GETFL);
+        if ((flags < 0) || ::fcntl(ptrState->eventFd, F_SETFL, flags | O_NONBLOCK))
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to set event file non-blocking.");
+
+        ptrState->stopFd = ::eventfd(0, EFD_CLOEXEC);
+        if (ptrState->stopFd < 0)
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to create stop event.");
+    }
+
+    static void CloseEventFd(std::shared_ptr<SState> ptrState)
+    {
+        if (ptrState->stopFd >= 0)
+            ::close(ptrState->stopFd);
+        ptrState->stopFd = -1;
+        if (ptrState->eventFd >= 0)
+            ::close(ptrState->eventFd);
+        ptrState->eventFd = -1;
+    }
+
+    /*
+     * Waits for the event without a timeout. Returns false if the thread
+     * should check the stop flag.
+     */
+    static bool PollEvent(std::shared_ptr<SState> ptrState, SBlksnapEvent& ev)
+    {
+        if (CBlksnap::ReadEvent(ptrState->eventFd, ev))
+            return true;
+
+        struct pollfd fds[2] = {
+          {.fd = ptrState->eventFd, .events = POLLIN, .revents = 0},
+          {.fd = ptrState->stopFd, .events = POLLIN, .revents = 0},
+        };
+        if (::poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                return false;
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to poll snapshot events.");
+        }
+        if (fds[1].revents)
+            return false;
+
+        return CBlksnap::ReadEvent(ptrState->eventFd, ev);
+    }
+
+    /*
+     * The module allocates the file itself and pins its blocks until the
+     * snapshot is destroyed. The pinned file cannot be grown, so the next
+     * file is appended when the diff storage runs low on free space.
+     */
+    static void AppendFileStorage(CBlksnap& blksnap, const uuid_t& id, const std::string& filename,
+                                  sector_t sectorCount)
+    {
+        int fd = ::open(filename.c_str(), O_CREAT | O_RDWR | O_EXCL | O_LARGEFILE, 0600);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to create file for diff storage.");
+
+        try
+        {
+            blksnap.AppendDiffStorageFile(id, fd, sectorCount);
+        }
+        catch (std::exception&)
+        {
+            ::remove(filename.c_str());
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+
     static void DeviceNumberByName(const std::string& deviceName, int& mj, int& mn)
     {
         struct stat64 st;
@@ -295,7 +401,10 @@ static void BlksnapThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<
     {
         try
         {
-            is_eventReady = ptrBlksnap->WaitEvent(ptrState->id, 100, ev);
+            if (ptrState->eventFd < 0)
+                is_eventReady = ptrBlksnap->WaitEvent(ptrState->id, 100, ev);
+            else
+                is_eventReady = PollEvent(ptrState, ev);
         }
         catch (std::exception& ex)
         {
@@ -329,6 +438,11 @@ static void BlksnapThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<
                         std::lock_guard<std::mutex> guard(ptrState->lock);
                         ptrState->diffStorageFiles.push_back(filename);
                     }
+                    if (IsAppendFileSupported(*ptrBlksnap))
+                    {
+                        AppendFileStorage(*ptrBlksnap, ptrState->id, filename, ev.lowFreeSpace.requestedSectors);
+                        break;
+                    }
                     FallocateStorage(filename, ev.lowFreeSpace.requestedSectors << SECTOR_SHIFT);
                     FiemapStorage(filename, dev_id, ranges);
                 }
@@ -386,6 +500,8 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
      */
     m_ptrState = std::make_shared<SState>();
     m_ptrState->stop = false;
+    m_ptrState->eventFd = -1;
+    m_ptrState->stopFd = -1;
     if (!diffStorage.empty())
         m_ptrState->diffStorage = diffStorage;
     if (!diffStorageRanges.ranges.empty())
@@ -416,6 +532,11 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
                 std::string filename = filepath.string();
 
                 m_ptrState->diffStorageFiles.push_back(filename);
+                if (IsAppendFileSupported(*m_ptrBlksnap))
+                {
+                    AppendFileStorage(*m_ptrBlksnap, m_id, filename, ev.lowFreeSpace.requestedSectors);
+                    break;
+                }
                 FallocateStorage(filename, ev.lowFreeSpace.requestedSectors << SECTOR_SHIFT);
                 FiemapStorage(filename, dev_id, ranges);
             }
@@ -440,6 +561,18 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
     /*
      * Start stretch snapshot thread
      */
+    if (IsEventFdSupported(*m_ptrBlksnap))
+    {
+        try
+        {
+            OpenEventFd(*m_ptrBlksnap, m_ptrState);
+        }
+        catch (std::exception&)
+        {
+            CloseEventFd(m_ptrState);
+            throw;
+        }
+    }
     m_ptrThread = std::make_shared<std::thread>(BlksnapThread, m_ptrBlksnap, m_ptrState);
     ::usleep(0);
 
@@ -476,7 +609,15 @@ CSession::~CSession()
      * Stop thread
      */
     m_ptrState->stop = true;
+    if (m_ptrState->stopFd >= 0)
+    {
+        uint64_t value = 1;
+
+        if (::write(m_ptrState->stopFd, &value, sizeof(value)) != sizeof(value))
+            std::cerr << "Failed to signal the stop event" << std::endl;
+    }
     m_ptrThread->join();
+    CloseEventFd(m_ptrState);
 
     /**
      * Destroy snapshot
@@ -544,3 +685,50 @@ bool CSession::GetError(std::string& errorMessage)
     m_ptrState->errorMessage.pop_front();
     return true;
 }
+
+void CSession::GetStorageUsage(SStorageUsage& usage)
+{
+    struct blk_snap_snapshot_storage_usage param;
+    std::vector<struct blk_snap_storage_dev_usage> storageDevices;
+    std::vector<struct blk_snap_orig_dev_usage> originalDevices;
+
+    m_ptrBlksnap->GetStorageUsage(m_id, param, storageDevices, originalDevices);
+
+    usage.capacity = param.capacity;
+    usage.filled = param.filled;
+    usage.requested = param.requested;
+    usage.wasted = param.wasted;
+    usage.regionCount = param.region_count;
+
+    usage.storageDevices.clear();
+    for (const auto& dev : storageDevices)
+    {
+        SStorageDeviceUsage devUsage;
+
+        devUsage.major = dev.dev_id.mj;
+        devUsage.minor = dev.dev_id.mn;
+        devUsage.capacity = dev.capacity;
+        devUsage.filled = dev.filled;
+        devUsage.wasted = dev.wasted;
+        usage.storageDevices.push_back(devUsage);
+    }
+
+    usage.originalDevices.clear();
+    for (const auto& dev : originalDevices)
+    {
+        SOriginalDeviceUsage devUsage;
+
+        devUsage.device = std::to_string(dev.dev_id.mj) + ":" + std::to_string(dev.dev_id.mn);
+        for (const SSessionInfo& info : m_devices)
+        {
+            if ((info.original.mj == dev.dev_id.mj) && (info.original.mn == dev.dev_id.mn))
+            {
+                devUsage.device = info.originalName;
+                break;
+            }
+        }
+        devUsage.stored = dev.stored;
+        devUsage.regionCount = dev.region_count;
+        usage.originalDevices.push_back(devUsage);
+    }
+}
@@ -41,6 +41,10 @@ enum blk_snap_ioctl {
 	blk_snap_ioctl_mod = IOCTL_MOD,
 	blk_snap_ioctl_setlog,
 	blk_snap_ioctl_get_sector_state,
+	blk_snap_ioctl_snapshot_append_file,
+	blk_snap_ioctl_snapshot_storage_stat,
+	blk_snap_ioctl_snapshot_storage_usage,
+	blk_snap_ioctl_snapshot_event_fd,
 	blk_snap_ioctl_end_mod
 #endif
 };
@@ -76,6 +80,10 @@ struct blk_snap_version {
 enum blk_snap_compat_flags {
 	blk_snap_compat_flag_debug_sector_state,
 	blk_snap_compat_flag_setlog,
+	blk_snap_compat_flag_append_file,
+	blk_snap_compat_flag_storage_stat,
+	blk_snap_compat_flag_storage_usage,
+	blk_snap_compat_flag_event_fd,
 	/*
 	 * Reserved for new features
 	 */
@@ -577,6 +585,202 @@ struct blk_snap_get_sector_state {
 	_IOW(BLK_SNAP, blk_snap_ioctl_get_sector_state,                        \
 	     struct blk_snap_get_sector_state)
 
+/**
+ * struct blk_snap_snapshot_append_file - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_APPEND_FILE control.
+ * @id:
+ *	Snapshot ID.
+ * @sector_count:
+ *	The initial size of the file in sectors.
+ * @fd:
+ *	The descriptor of a regular file opened for writing.
+ */
+struct blk_snap_snapshot_append_file {
+	struct blk_snap_uuid id;
+	__u64 sector_count;
+	__s32 fd;
+};
+
+/**
+ * IOCTL_BLK_SNAP_SNAPSHOT_APPEND_FILE - Append a file to the difference
+ *	storage.
+ *
+ * The module allocates the file, maps its blocks on the block device of the
+ * file system and pins them like the blocks of a swap file. While the
+ * snapshot exists, the file cannot be written, truncated or grown. When the
+ * difference storage runs low on free space, the next file can be appended
+ * in response to the &blk_snap_event_code_low_free_space event.
+ *
+ * The file system should support the bmap operation and should provide
+ * stable extents of the file. The files on the copy-on-write file systems
+ * and the files with shared extents are refused. The file located on a
+ * device of a taken snapshot is refused with EBUSY, since its allocation
+ * would be copied to the difference storage being appended.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_APPEND_FILE                                    \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_append_file,                    \
+	     struct blk_snap_snapshot_append_file)
+
+/**
+ * struct blk_snap_snapshot_storage_stat - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_STAT control.
+ * @id:
+ *	Snapshot ID.
+ * @capacity:
+ *	The number of sectors appended to the difference storage.
+ * @filled:
+ *	The number of sectors already filled in.
+ * @requested:
+ *	The number of sectors requested by the low free space events.
+ * @fill_rate:
+ *	The average number of sectors filled in per second. It is calculated
+ *	when the next part of the difference storage is reserved, so the
+ *	request for the statistics does not change it.
+ */
+struct blk_snap_snapshot_storage_stat {
+	struct blk_snap_uuid id;
+	__u64 capacity;
+	__u64 filled;
+	__u64 requested;
+	__u64 fill_rate;
+};
+
+/**
+ * IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_STAT - Get the statistics of the difference
+ *	storage.
+ *
+ * The low free space event is generated when the free space is not enough
+ * for the diff_storage_horizon seconds at the current fill rate. The event
+ * requests the space for this time, but not less than diff_storage_minimum.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_STAT                                   \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_storage_stat,                   \
+	     struct blk_snap_snapshot_storage_stat)
+
+/**
+ * struct blk_snap_storage_dev_usage - The usage of a block device of the
+ *	difference storage.
+ * @dev_id:
+ *	Block device ID.
+ * @capacity:
+ *	The number of sectors appended to the difference storage on this
+ *	block device.
+ * @filled:
+ *	The number of sectors already filled in, including the wasted ones.
+ * @wasted:
+ *	The number of sectors left unused at the ends of the appended ranges
+ *	since they were too small for the next reserved part.
+ */
+struct blk_snap_storage_dev_usage {
+	struct blk_snap_dev dev_id;
+	__u64 capacity;
+	__u64 filled;
+	__u64 wasted;
+};
+
+/**
+ * struct blk_snap_orig_dev_usage - The consumption of the difference storage
+ *	by an original block device.
+ * @dev_id:
+ *	Original block device ID.
+ * @stored:
+ *	The number of sectors of the regions allocated for the chunks of this
+ *	block device.
+ * @region_count:
+ *	The number of regions allocated for the chunks of this block device.
+ */
+struct blk_snap_orig_dev_usage {
+	struct blk_snap_dev dev_id;
+	__u64 stored;
+	__u64 region_count;
+};
+
+/**
+ * struct blk_snap_snapshot_storage_usage - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_USAGE control.
+ * @id:
+ *	Snapshot ID.
+ * @capacity:
+ *	The number of sectors appended to the difference storage.
+ * @filled:
+ *	The number of sectors already filled in, including the wasted ones.
+ * @requested:
+ *	The number of sectors requested by the low free space events.
+ * @wasted:
+ *	The number of sectors left unused at the ends of the appended ranges.
+ * @region_count:
+ *	The number of regions allocated for the chunks of all the original
+ *	block devices.
+ * @storage_dev_count:
+ *	Size of @storage_dev_array in the number of
+ *	&struct blk_snap_storage_dev_usage. Contains the number of block
+ *	devices of the difference storage on return.
+ * @orig_dev_count:
+ *	Size of @orig_dev_array in the number of &struct blk_snap_orig_dev_usage.
+ *	Contains the number of original block devices on return.
+ * @storage_dev_array:
+ *	Pointer to the array for output. May be NULL.
+ * @orig_dev_array:
+ *	Pointer to the array for output. May be NULL.
+ */
+struct blk_snap_snapshot_storage_usage {
+	struct blk_snap_uuid id;
+	__u64 capacity;
+	__u64 filled;
+	__u64 requested;
+	__u64 wasted;
+	__u64 region_count;
+	__u32 storage_dev_count;
+	__u32 orig_dev_count;
+	struct blk_snap_storage_dev_usage *storage_dev_array;
+	struct blk_snap_orig_dev_usage *orig_dev_array;
+};
+
+/**
+ * IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_USAGE - Get the usage of the difference
+ *	storage.
+ *
+ * Allows to estimate the size of the difference storage. If an array is not
+ * set, only the number of its elements is returned. If an array has not
+ * enough space, the ioctl fails with ENODATA and returns the required number
+ * of elements.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_USAGE                                  \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_storage_usage,                  \
+	     struct blk_snap_snapshot_storage_usage)
+
+/**
+ * struct blk_snap_snapshot_event_fd - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD control.
+ * @id:
+ *	Snapshot ID.
+ * @fd:
+ *	The file descriptor of the events of the snapshot.
+ */
+struct blk_snap_snapshot_event_fd {
+	struct blk_snap_uuid id;
+	__s32 fd;
+};
+
+/**
+ * IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD - Open a file descriptor for receiving
+ *	the events of the snapshot.
+ *
+ * The file descriptor can be used with poll() and epoll(), so one thread can
+ * wait for the events of many snapshots. The read() from it returns as many
+ * events as fit into the buffer, each of them as &struct
+ * blk_snap_snapshot_event. The buffer must fit at least one event. The read()
+ * blocks until an event appears, unless the file descriptor is non-blocking.
+ *
+ * The file descriptor shares the queue of events with the
+ * &IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENT control, so each event is received
+ * only once. When the snapshot is destroyed, poll() reports EPOLLHUP and
+ * read() returns 0 after the remaining events have been read.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD                                       \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_event_fd,                       \
+	     struct blk_snap_snapshot_event_fd)
+
 #endif /* BLK_SNAP_MODIFICATION */
 
 #endif /* __LINUX_BLK_SNAP_H */
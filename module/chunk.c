@@ -10,6 +10,7 @@
 #include "diff_buffer.h"
 #include "diff_area.h"
 #include "diff_storage.h"
+#include "diff_compress.h"
 #ifdef STANDALONE_BDEVFILTER
 #include "log.h"
 #endif
@@ -18,6 +19,42 @@
 DEFINE_MUTEX(logging_lock);
 #endif
 
+static inline void chunk_write_waiter_leave(struct chunk *chunk)
+{
+	/* The readers could wait until there are no writers waiting. */
+	if (atomic_dec_and_test(&chunk->write_waiters))
+		wake_up_var(&chunk->lock);
+}
+
+void chunk_lock_write(struct chunk *chunk)
+{
+	if (chunk_trylock_write(chunk))
+		return;
+
+	atomic_inc(&chunk->write_waiters);
+	wait_var_event(&chunk->lock, chunk_trylock_write(chunk));
+	chunk_write_waiter_leave(chunk);
+}
+
+int chunk_lock_write_killable(struct chunk *chunk)
+{
+	int ret;
+
+	if (chunk_trylock_write(chunk))
+		return 0;
+
+	atomic_inc(&chunk->write_waiters);
+	ret = wait_var_event_killable(&chunk->lock, chunk_trylock_write(chunk));
+	chunk_write_waiter_leave(chunk);
+
+	return ret;
+}
+
+int chunk_lock_read_killable(struct chunk *chunk)
+{
+	return wait_var_event_killable(&chunk->lock, chunk_trylock_read(chunk));
+}
+
 void chunk_diff_buffer_release(struct chunk *chunk)
 {
 	if (unlikely(!chunk->diff_buffer))
@@ -34,17 +71,233 @@ void chunk_store_failed(struct chunk *chunk, int error)
 
 	chunk_state_set(chunk, CHUNK_ST_FAILED);
 	chunk_diff_buffer_release(chunk);
-	diff_storage_free_region(chunk->diff_region);
-	chunk->diff_region = NULL;
+	chunk->diff_region.bdev = NULL;
+	diff_storage_dedup_free(chunk->dedup);
+	chunk->dedup = NULL;
 
-	up(&chunk->lock);
+	chunk_unlock_write(chunk);
 	if (error)
 		diff_area_set_corrupted(diff_area, error);
 };
 
+/*
+ * Compresses the data of the chunk in its buffer. After that, the buffer
+ * cannot be used for reading the chunk data. Returns the number of sectors
+ * in the region that is required to store the chunk. The size of the data
+ * to store is returned in the size parameter.
+ */
+static sector_t chunk_compress(struct chunk *chunk, bool is_nowait,
+			       size_t *size)
+{
+	sector_t count = diff_area_chunk_sectors(chunk->diff_area);
+	size_t compressed_size;
+
+	*size = chunk->sector_count << SECTOR_SHIFT;
+	chunk_state_unset(chunk, CHUNK_ST_COMPRESSED);
+	/*
+	 * The compression can sleep, so the chunks that are stored without
+	 * waiting are not compressed.
+	 */
+	if (!diff_compress_enabled() || is_nowait)
+		return count;
+
+	if (diff_compress(chunk->diff_buffer,
+			  chunk->sector_count << SECTOR_SHIFT,
+			  &compressed_size))
+		return count;
+
+	chunk_state_unset(chunk, CHUNK_ST_BUFFER_READY);
+	chunk_state_set(chunk, CHUNK_ST_COMPRESSED);
+	*size = compressed_size;
+	return round_up(compressed_size, PAGE_SIZE) >> SECTOR_SHIFT;
+}
+
+/*
+ * The chunk has been stored. The buffer of the dirty chunk is released,
+ * and the rest of the chunks get into the read cache.
+ */
+static void chunk_store_done(struct chunk *chunk)
+{
+	chunk_state_set(chunk, CHUNK_ST_STORE_READY);
+
+	if (chunk_state_check(chunk, CHUNK_ST_DIRTY | CHUNK_ST_COMPRESSED)) {
+		/*
+		 * The chunk marked "dirty" was stored in the difference
+		 * storage. Now it is processed in the same way as any
+		 * other stored chunks.
+		 * Therefore, the "dirty" mark can be removed.
+		 * The buffer of the compressed chunk does not contain
+		 * the chunk data, so it cannot get into the cache.
+		 */
+		chunk_state_unset(chunk, CHUNK_ST_DIRTY);
+#ifdef BLK_SNAP_DEBUG_IMAGE_WRITE
+		pr_debug("chunk #%ld has been stored\n", chunk->number);
+		pr_debug("Release buffer for chunk #%ld\n", chunk->number);
+#endif
+		chunk_diff_buffer_release(chunk);
+		chunk_unlock_write(chunk);
+	} else
+		chunk_schedule_caching(chunk);
+}
+
+/*
+ * The region of the chunk that has already been stored is reused if the data
+ * fits into it. The regions can be shared by several chunks when the
+ * deduplication is enabled, so they are not overwritten.
+ */
+static int chunk_store_region(struct chunk *chunk, sector_t count,
+			      bool is_nowait)
+{
+	struct diff_area *diff_area = chunk->diff_area;
+
+	if (!chunk->diff_region.bdev || (chunk->diff_region.count < count) ||
+	    diff_storage_dedup_enabled(diff_area->diff_storage)) {
+		int ret;
+
+		ret = diff_storage_new_region(diff_area->diff_storage, count,
+					      &chunk->diff_region);
+		if (ret) {
+			pr_debug("Cannot get store for chunk #%ld\n",
+				 chunk->number);
+			return ret;
+		}
+		atomic64_add(count, &diff_area->stored_sectors);
+		atomic64_inc(&diff_area->region_count);
+	} else
+		chunk->diff_region.count = count;
+
+	return chunk_async_store_diff(chunk, is_nowait);
+}
+
+static int chunk_dedup_next(struct chunk *chunk, struct diff_region *prev,
+			    bool is_nowait);
+
+/*
+ * The region found in the deduplication index has been read. If its data is
+ * the same as the data of the chunk, the chunk shares this region. Otherwise,
+ * the next region with the same hash is compared, and if there are no more
+ * such regions, the chunk is stored in a new region.
+ */
+static void chunk_notify_dedup(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
+	struct diff_storage_dedup *dedup = chunk->dedup;
+	struct diff_region region = chunk->diff_region;
+	bool is_equal = false;
+	unsigned int current_flag;
+	int ret;
+
+	if (!chunk->diff_io->error)
+		is_equal = diff_buffer_equal(chunk->diff_buffer,
+					     dedup->diff_buffer, dedup->size);
+	diff_io_free(chunk->diff_io);
+	chunk->diff_io = NULL;
+	diff_buffer_release(diff_area, dedup->diff_buffer);
+	dedup->diff_buffer = NULL;
+
+	if (is_equal) {
+		diff_storage_dedup_free(dedup);
+		chunk->dedup = NULL;
+		chunk_store_done(chunk);
+		goto out;
+	}
+
+	current_flag = memalloc_noio_save();
+	ret = chunk_dedup_next(chunk, &region, false);
+	if (ret == -ENOENT)
+		ret = chunk_store_region(chunk, dedup->is_compressed ?
+			round_up(dedup->size, PAGE_SIZE) >> SECTOR_SHIFT :
+			diff_area_chunk_sectors(diff_area), false);
+	memalloc_noio_restore(current_flag);
+	if (ret)
+		chunk_store_failed(chunk, ret);
+out:
+	diff_area_io_end(diff_area, false);
+}
+
+/*
+ * Starts reading the next region with the same hash to compare its data with
+ * the data of the chunk. The buffer for the region is taken only if it is
+ * available without waiting, so the deduplication does not hold back the
+ * copy-on-write and the release of the cache. Returns -ENOENT if there is
+ * nothing to compare.
+ */
+static int chunk_dedup_next(struct chunk *chunk, struct diff_region *prev,
+			    bool is_nowait)
+{
+	int ret;
+	struct diff_area *diff_area = chunk->diff_area;
+	struct diff_storage_dedup *dedup = chunk->dedup;
+	struct diff_buffer *diff_buffer;
+	struct diff_io *diff_io;
+	struct diff_region region;
+
+	if (!diff_storage_dedup_lookup(diff_area->diff_storage, dedup, prev,
+				       &region))
+		return -ENOENT;
+
+	diff_buffer = diff_buffer_take(diff_area, true);
+	if (IS_ERR(diff_buffer))
+		return -ENOENT;
+
+	diff_io = diff_io_new_async_read(chunk_notify_dedup, chunk, is_nowait);
+	if (unlikely(!diff_io)) {
+		diff_buffer_release(diff_area, diff_buffer);
+		return -ENOENT;
+	}
+
+	dedup->diff_buffer = diff_buffer;
+	chunk->diff_region = region;
+	WARN_ON(chunk->diff_io);
+	chunk->diff_io = diff_io;
+	diff_area_io_start(diff_area, false);
+
+	ret = diff_io_do(diff_io, &region, diff_buffer, is_nowait);
+	if (ret) {
+		diff_area_io_end(diff_area, false);
+		diff_io_free(diff_io);
+		chunk->diff_io = NULL;
+		diff_buffer_release(diff_area, diff_buffer);
+		dedup->diff_buffer = NULL;
+		return -ENOENT;
+	}
+	return 0;
+}
+
+/*
+ * Looks for the region of the difference storage that already contains the
+ * same data as the chunk is going to store. If such a region may exist, its
+ * data is compared asynchronously, and the storing of the chunk is continued
+ * when the comparison is completed. The chunk gets the entry that will be
+ * added to the deduplication index when the data has been written.
+ * The chunks stored without waiting are not deduplicated, since hashing and
+ * comparing the data would hold back the copy-on-write.
+ * Returns -ENOENT if the chunk should be stored in a new region right away.
+ */
+static int chunk_dedup(struct chunk *chunk, size_t size, bool is_nowait)
+{
+	struct diff_storage *diff_storage = chunk->diff_area->diff_storage;
+
+	diff_storage_dedup_free(chunk->dedup);
+	chunk->dedup = NULL;
+	if (!diff_storage_dedup_enabled(diff_storage) || is_nowait)
+		return -ENOENT;
+
+	chunk->dedup = diff_storage_dedup_new(
+		diff_buffer_hash(chunk->diff_buffer, size), size,
+		chunk_state_check(chunk, CHUNK_ST_COMPRESSED));
+	if (!chunk->dedup)
+		return -ENOENT;
+
+	return chunk_dedup_next(chunk, NULL, is_nowait);
+}
+
 int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 {
 	struct diff_area *diff_area = chunk->diff_area;
+	sector_t count;
+	size_t size;
 
 	if (WARN(!list_is_first(&chunk->cache_link, &chunk->cache_link),
 		 "The chunk already in the cache"))
@@ -52,36 +305,49 @@ int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 
 #ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
 	if (diff_area->in_memory) {
-		up(&chunk->lock);
+		chunk_unlock_write(chunk);
 		return 0;
 	}
 #endif
-	if (!chunk->diff_region) {
-		struct diff_region *diff_region;
-
-		diff_region = diff_storage_new_region(
-			diff_area->diff_storage,
-			diff_area_chunk_sectors(diff_area));
-		if (IS_ERR(diff_region)) {
-			pr_debug("Cannot get store for chunk #%ld\n",
-				 chunk->number);
-			return PTR_ERR(diff_region);
-		}
+	/*
+	 * The chunk that consists of zeros does not need to be written.
+	 */
+	if (diff_buffer_is_zero(chunk->diff_buffer,
+				chunk->sector_count << SECTOR_SHIFT)) {
+		chunk_state_unset(chunk, CHUNK_ST_COMPRESSED);
+		chunk_state_set(chunk, CHUNK_ST_ZERO);
+		chunk_store_done(chunk);
+		return 0;
+	}
+	chunk_state_unset(chunk, CHUNK_ST_ZERO);
 
-		chunk->diff_region = diff_region;
+	/*
+	 * If the RAM tier is enabled, the chunk copied from the original block
+	 * device is kept in memory as a dirty chunk. It will be stored by the
+	 * cache release worker when the high watermark is exceeded.
+	 */
+	if (chunk_ram_tier_high && !chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
+		chunk_state_set(chunk, CHUNK_ST_DIRTY);
+		chunk_schedule_caching(chunk);
+		return 0;
 	}
 
-	return chunk_async_store_diff(chunk, is_nowait);
+	count = chunk_compress(chunk, is_nowait, &size);
+
+	if (!chunk_dedup(chunk, size, is_nowait))
+		return 0;
+
+	return chunk_store_region(chunk, count, is_nowait);
 }
 
 void chunk_schedule_caching(struct chunk *chunk)
 {
 	int in_cache_count = 0;
+	bool is_dirty = chunk_state_check(chunk, CHUNK_ST_DIRTY);
 	struct diff_area *diff_area = chunk->diff_area;
+	unsigned long flags;
 
-	might_sleep();
-
-	spin_lock(&diff_area->caches_lock);
+	spin_lock_irqsave(&diff_area->caches_lock, flags);
 
 	/*
 	 * The locked chunk cannot be in the cache.
@@ -90,13 +356,13 @@ void chunk_schedule_caching(struct chunk *chunk)
 	 */
 	if (WARN(!list_is_first(&chunk->cache_link, &chunk->cache_link),
 		 "The chunk already in the cache")) {
-		spin_unlock(&diff_area->caches_lock);
+		spin_unlock_irqrestore(&diff_area->caches_lock, flags);
 
 		chunk_store_failed(chunk, 0);
 		return;
 	}
 
-	if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
+	if (is_dirty) {
 		list_add_tail(&chunk->cache_link,
 			      &diff_area->write_cache_queue);
 		in_cache_count =
@@ -110,9 +376,9 @@ void chunk_schedule_caching(struct chunk *chunk)
 		in_cache_count =
 			atomic_inc_return(&diff_area->read_cache_count);
 	}
-	spin_unlock(&diff_area->caches_lock);
+	spin_unlock_irqrestore(&diff_area->caches_lock, flags);
 
-	up(&chunk->lock);
+	chunk_unlock_write(chunk);
 
 	/* Initiate the cache clearing process */
 #ifdef BLK_SNAP_DEBUG_IMAGE_WRITE
@@ -124,9 +390,99 @@ void chunk_schedule_caching(struct chunk *chunk)
 			chunk_maximum_in_cache);
 	}
 #endif
-	if ((in_cache_count > chunk_maximum_in_cache) &&
-	    !diff_area_is_corrupted(diff_area))
-		queue_work(system_wq, &diff_area->cache_release_work);
+	if ((in_cache_count > (is_dirty ? diff_area_write_cache_high()
+					: chunk_maximum_in_cache)) &&
+	    !diff_area_is_corrupted(diff_area)) {
+		/*
+		 * The read cache is allowed to grow while there is plenty
+		 * of memory. The shrinker will take care of it later.
+		 */
+		if (is_dirty || !diff_buffer_memory_plentiful())
+			queue_work(diff_area->cache_release_wq,
+				   &diff_area->cache_release_work);
+	}
+}
+
+static void chunk_share_open(struct chunk *chunk)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chunk->diff_area->caches_lock, flags);
+	chunk->is_share_open = true;
+	spin_unlock_irqrestore(&chunk->diff_area->caches_lock, flags);
+}
+
+/*
+ * Passes the loaded data to the chunks of other snapshots that were waiting
+ * for it. The data of the leader chunk should not be changed until the
+ * function is complete.
+ */
+static void chunk_share_complete(struct chunk *chunk, int error)
+{
+	unsigned long flags;
+	unsigned int current_flag;
+	struct chunk *follower;
+	struct chunk *next;
+
+	spin_lock_irqsave(&chunk->diff_area->caches_lock, flags);
+	chunk->is_share_open = false;
+	follower = chunk->share_next;
+	chunk->share_next = NULL;
+	spin_unlock_irqrestore(&chunk->diff_area->caches_lock, flags);
+
+	if (!follower)
+		return;
+
+	current_flag = memalloc_noio_save();
+	for (; follower; follower = next) {
+		struct diff_area *diff_area = follower->diff_area;
+		int ret = error;
+
+		next = follower->share_next;
+		follower->share_next = NULL;
+
+		chunk_state_unset(follower, CHUNK_ST_LOADING);
+		if (!ret) {
+			diff_buffer_copy(follower->diff_buffer,
+					 chunk->diff_buffer);
+			chunk_state_set(follower, CHUNK_ST_BUFFER_READY);
+			ret = chunk_schedule_storing(follower, false);
+		}
+		if (ret)
+			chunk_store_failed(follower, ret);
+		diff_area_io_end(diff_area, false);
+	}
+	memalloc_noio_restore(current_flag);
+}
+
+/**
+ * chunk_share_load() - Makes the chunk wait for the data of the leader chunk
+ *	that is being loaded from the original block device.
+ *
+ * The chunk should be locked for writing and should have a buffer. Returns
+ * false if the leader is not being loaded. In this case, the chunk should
+ * be loaded by itself.
+ */
+bool chunk_share_load(struct chunk *leader, struct chunk *chunk)
+{
+	unsigned long flags;
+	bool ret = false;
+
+	if (leader->sector_count != chunk->sector_count)
+		return false;
+
+	spin_lock_irqsave(&leader->diff_area->caches_lock, flags);
+	if (leader->is_share_open) {
+		chunk_state_set(chunk, CHUNK_ST_LOADING);
+		diff_area_io_start(chunk->diff_area, false);
+
+		chunk->share_next = leader->share_next;
+		leader->share_next = chunk;
+		ret = true;
+	}
+	spin_unlock_irqrestore(&leader->diff_area->caches_lock, flags);
+
+	return ret;
 }
 
 static void chunk_notify_load(void *ctx)
@@ -137,6 +493,11 @@ static void chunk_notify_load(void *ctx)
 	diff_io_free(chunk->diff_io);
 	chunk->diff_io = NULL;
 
+	if (unlikely(!error && chunk_state_check(chunk, CHUNK_ST_FAILED)))
+		chunk_share_complete(chunk, -EIO);
+	else
+		chunk_share_complete(chunk, error);
+
 #ifdef BLK_SNAP_DEBUG_CHUNK_IO
 	mutex_lock(&logging_lock);
 	pr_debug("DEBUG! loaded chunk #%ld \n", chunk->number);
@@ -153,7 +514,7 @@ static void chunk_notify_load(void *ctx)
 
 	if (unlikely(chunk_state_check(chunk, CHUNK_ST_FAILED))) {
 		pr_err("Chunk in a failed state\n");
-		up(&chunk->lock);
+		chunk_unlock_write(chunk);
 		goto out;
 	}
 
@@ -173,11 +534,15 @@ static void chunk_notify_load(void *ctx)
 	}
 
 	pr_err("invalid chunk state 0x%x\n", atomic_read(&chunk->state));
-	up(&chunk->lock);
+	chunk_unlock_write(chunk);
 out:
-	atomic_dec(&chunk->diff_area->pending_io_count);
+	diff_area_io_end(chunk->diff_area, false);
 }
 
+/*
+ * If the chunk was stored successfully, this function is called directly
+ * from the bio completion handler, so it must not sleep.
+ */
 static void chunk_notify_store(void *ctx)
 {
 	struct chunk *chunk = ctx;
@@ -186,8 +551,6 @@ static void chunk_notify_store(void *ctx)
 	diff_io_free(chunk->diff_io);
 	chunk->diff_io = NULL;
 
-	might_sleep();
-
 	if (unlikely(error)) {
 		chunk_store_failed(chunk, error);
 		goto out;
@@ -200,35 +563,19 @@ static void chunk_notify_store(void *ctx)
 	}
 	if (chunk_state_check(chunk, CHUNK_ST_STORING)) {
 		chunk_state_unset(chunk, CHUNK_ST_STORING);
-		chunk_state_set(chunk, CHUNK_ST_STORE_READY);
-
-		if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
-			/*
-			 * The chunk marked "dirty" was stored in the difference
-			 * storage. Now it is processed in the same way as any
-			 * other stored chunks.
-			 * Therefore, the "dirty" mark can be removed.
-			 */
-			chunk_state_unset(chunk, CHUNK_ST_DIRTY);
-#ifdef BLK_SNAP_DEBUG_IMAGE_WRITE
-			pr_debug("chunk #%ld has been stored\n", chunk->number);
-			pr_debug("Release buffer for chunk #%ld\n",
-				 chunk->number);
-#endif
-			chunk_diff_buffer_release(chunk);
-		} else {
-			unsigned int current_flag;
-
-			current_flag = memalloc_noio_save();
-			chunk_schedule_caching(chunk);
-			memalloc_noio_restore(current_flag);
-			goto out;
+		if (chunk->dedup) {
+			diff_storage_dedup_add(chunk->diff_area->diff_storage,
+					       chunk->dedup,
+					       &chunk->diff_region);
+			chunk->dedup = NULL;
 		}
-	} else
+		chunk_store_done(chunk);
+	} else {
 		pr_err("invalid chunk state 0x%x\n", atomic_read(&chunk->state));
-	up(&chunk->lock);
+		chunk_unlock_write(chunk);
+	}
 out:
-	atomic_dec(&chunk->diff_area->pending_io_count);
+	diff_area_io_end(chunk->diff_area, false);
 }
 
 struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number)
@@ -241,7 +588,8 @@ struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number)
 	memory_object_inc(memory_object_chunk);
 
 	INIT_LIST_HEAD(&chunk->cache_link);
-	sema_init(&chunk->lock, 1);
+	atomic_set(&chunk->lock, 0);
+	atomic_set(&chunk->write_waiters, 0);
 	chunk->diff_area = diff_area;
 	chunk->number = number;
 	atomic_set(&chunk->state, 0);
@@ -254,11 +602,12 @@ void chunk_free(struct chunk *chunk)
 	if (unlikely(!chunk))
 		return;
 
-	down(&chunk->lock);
+	chunk_lock_write(chunk);
 	chunk_diff_buffer_release(chunk);
-	diff_storage_free_region(chunk->diff_region);
+	diff_storage_dedup_free(chunk->dedup);
+	chunk->dedup = NULL;
 	chunk_state_set(chunk, CHUNK_ST_FAILED);
-	up(&chunk->lock);
+	chunk_unlock_write(chunk);
 
 	kfree(chunk);
 	memory_object_dec(memory_object_chunk);
@@ -273,7 +622,7 @@ int chunk_async_store_diff(struct chunk *chunk, bool is_nowait)
 {
 	int ret;
 	struct diff_io *diff_io;
-	struct diff_region *region = chunk->diff_region;
+	struct diff_region *region = &chunk->diff_region;
 
 	if (WARN(!list_is_first(&chunk->cache_link, &chunk->cache_link),
 		 "The chunk already in the cache"))
@@ -287,7 +636,8 @@ int chunk_async_store_diff(struct chunk *chunk, bool is_nowait)
 		       page_address(chunk->diff_buffer->pages[0]), 96, true);
 	mutex_unlock(&logging_lock);
 #endif
-	diff_io = diff_io_new_async_write(chunk_notify_store, chunk, is_nowait);
+	diff_io = diff_io_new_async_write_atomic(chunk_notify_store, chunk,
+						 is_nowait);
 	if (unlikely(!diff_io)) {
 		if (is_nowait)
 			return -EAGAIN;
@@ -298,11 +648,11 @@ int chunk_async_store_diff(struct chunk *chunk, bool is_nowait)
 	WARN_ON(chunk->diff_io);
 	chunk->diff_io = diff_io;
 	chunk_state_set(chunk, CHUNK_ST_STORING);
-	atomic_inc(&chunk->diff_area->pending_io_count);
+	diff_area_io_start(chunk->diff_area, false);
 
 	ret = diff_io_do(chunk->diff_io, region, chunk->diff_buffer, is_nowait);
 	if (ret) {
-		atomic_dec(&chunk->diff_area->pending_io_count);
+		diff_area_io_end(chunk->diff_area, false);
 		diff_io_free(chunk->diff_io);
 		chunk->diff_io = NULL;
 #ifdef BLK_SNAP_DEBUG_IMAGE_WRITE
@@ -344,17 +694,103 @@ int chunk_async_load_orig(struct chunk *chunk, const bool is_nowait)
 	WARN_ON(chunk->diff_io);
 	chunk->diff_io = diff_io;
 	chunk_state_set(chunk, CHUNK_ST_LOADING);
-	atomic_inc(&chunk->diff_area->pending_io_count);
+	chunk_share_open(chunk);
+	diff_area_io_start(chunk->diff_area, false);
 
 	ret = diff_io_do(chunk->diff_io, &region, chunk->diff_buffer, is_nowait);
 	if (ret) {
-		atomic_dec(&chunk->diff_area->pending_io_count);
+		chunk_share_complete(chunk, ret);
+		diff_area_io_end(chunk->diff_area, false);
+		diff_io_free(chunk->diff_io);
+		chunk->diff_io = NULL;
+	}
+	return ret;
+}
+
+/*
+ * The prefetched chunk is queued for decompression, since this function is
+ * called directly from the bio completion handler and must not sleep. If the
+ * loading has failed, then the buffer is released, but the snapshot is not
+ * corrupted, since the data will be read again on demand.
+ */
+static void chunk_notify_prefetch(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
+	int error = chunk->diff_io->error;
+	unsigned long flags;
+
+	diff_io_free(chunk->diff_io);
+	chunk->diff_io = NULL;
+
+	chunk_state_unset(chunk, CHUNK_ST_LOADING);
+	if (unlikely(error)) {
+		chunk_diff_buffer_release(chunk);
+		chunk_unlock_write(chunk);
+	} else {
+		spin_lock_irqsave(&diff_area->caches_lock, flags);
+		list_add_tail(&chunk->cache_link, &diff_area->prefetch_queue);
+		spin_unlock_irqrestore(&diff_area->caches_lock, flags);
+
+		queue_work(diff_area->cache_release_wq,
+			   &diff_area->prefetch_work);
+	}
+	diff_area_io_end(diff_area, true);
+}
+
+/**
+ * chunk_async_prefetch() - Starts asynchronous loading of a compressed chunk
+ *	from the difference storage into the read cache.
+ *
+ * The chunk should be locked for writing and should have a buffer. The lock
+ * is released when the chunk is decompressed and put in the read cache.
+ */
+int chunk_async_prefetch(struct chunk *chunk)
+{
+	int ret;
+	struct diff_io *diff_io;
+
+	diff_io = diff_io_new_async(false, true, true, chunk_notify_prefetch,
+				    chunk);
+	if (unlikely(!diff_io))
+		return -EAGAIN;
+
+	WARN_ON(chunk->diff_io);
+	chunk->diff_io = diff_io;
+	chunk_state_set(chunk, CHUNK_ST_LOADING);
+	diff_area_io_start(chunk->diff_area, true);
+
+	ret = diff_io_do(chunk->diff_io, &chunk->diff_region,
+			 chunk->diff_buffer, true);
+	if (ret) {
+		chunk_state_unset(chunk, CHUNK_ST_LOADING);
+		diff_area_io_end(chunk->diff_area, true);
 		diff_io_free(chunk->diff_io);
 		chunk->diff_io = NULL;
 	}
 	return ret;
 }
 
+/**
+ * chunk_prefetch_complete() - Decompresses the prefetched chunk and puts it
+ *	in the read cache.
+ *
+ * Called from the worker of the diff area. The chunk lock taken by
+ * diff_area_prefetch_chunk() is released here.
+ */
+void chunk_prefetch_complete(struct chunk *chunk)
+{
+	if (diff_decompress(chunk->diff_buffer,
+			    chunk->sector_count << SECTOR_SHIFT)) {
+		chunk_diff_buffer_release(chunk);
+		chunk_unlock_write(chunk);
+		return;
+	}
+
+	chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+	chunk_schedule_caching(chunk);
+}
+
 /**
  * chunk_load_orig() - Performs synchronous loading of a chunk from the
  *	original block device.
@@ -390,8 +826,12 @@ int chunk_load_diff(struct chunk *chunk)
 {
 	int ret;
 	struct diff_io *diff_io;
-	struct diff_region *region = chunk->diff_region;
+	struct diff_region *region = &chunk->diff_region;
 
+	if (chunk_state_check(chunk, CHUNK_ST_ZERO)) {
+		diff_buffer_clear(chunk->diff_buffer);
+		return 0;
+	}
 #ifdef BLK_SNAP_DEBUG_CHUNK_IO
 	pr_debug("%s chunk #%ld sector=%llu count=%llu", __FUNCTION__,
 		 chunk->number, region->sector, region->count);
@@ -405,6 +845,9 @@ int chunk_load_diff(struct chunk *chunk)
 		ret = diff_io->error;
 
 	diff_io_free(diff_io);
+	if (!ret && chunk_state_check(chunk, CHUNK_ST_COMPRESSED))
+		ret = diff_decompress(chunk->diff_buffer,
+				      chunk->sector_count << SECTOR_SHIFT);
 #ifdef BLK_SNAP_DEBUG_CHUNK_IO
 	mutex_lock(&logging_lock);
 	pr_debug("DEBUG! loaded chunk #%ld from diff area\n", chunk->number);
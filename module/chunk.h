@@ -6,10 +6,11 @@
 #include <linux/blkdev.h>
 #include <linux/rwsem.h>
 #include <linux/atomic.h>
+#include <linux/wait_bit.h>
+#include "diff_io.h"
 
 struct diff_area;
-struct diff_region;
-struct diff_io;
+struct diff_storage_dedup;
 
 /**
  * enum chunk_st - Possible states for a chunk.
@@ -34,6 +35,18 @@ struct diff_io;
  * @CHUNK_ST_STORING:
  *	The data is being saved to the difference storage.
  *	The flag is replaced with the CHUNK_ST_STORE_READY flag.
+ * @CHUNK_ST_COMPRESSED:
+ *	The data of the chunk is compressed in its buffer and in the region
+ *	of the difference storage. The flag replaces the CHUNK_ST_BUFFER_READY
+ *	flag when the chunk is being stored, and the buffer is released as
+ *	soon as the chunk is stored. The flag is removed if the chunk is
+ *	stored again without the compression.
+ * @CHUNK_ST_ZERO:
+ *	The data of the chunk consists of zeros. Such a chunk is considered
+ *	stored without writing to the difference storage and its data is not
+ *	read from anywhere. The flag is set together with the
+ *	CHUNK_ST_STORE_READY flag and removed if the chunk is stored again
+ *	with other data.
  *
  * Chunks life circle.
  * Copy-on-write when writing to original:
@@ -50,6 +63,8 @@ enum chunk_st {
 	CHUNK_ST_STORE_READY = (1 << 3),
 	CHUNK_ST_LOADING = (1 << 4),
 	CHUNK_ST_STORING = (1 << 5),
+	CHUNK_ST_COMPRESSED = (1 << 6),
+	CHUNK_ST_ZERO = (1 << 7),
 };
 
 /**
@@ -65,18 +80,34 @@ enum chunk_st {
  *	Number of sectors in the current chunk. This is especially true
  *	for the	last chunk.
  * @lock:
- *	Binary semaphore. Syncs access to the chunks fields: state,
- *	diff_buffer, diff_region and diff_io.
+ *	Reader/writer lock. Syncs access to the chunks fields: state,
+ *	diff_buffer, diff_region and diff_io. Contains zero if the chunk is
+ *	unlocked, CHUNK_LOCK_WRITER if it is locked for writing, or the
+ *	number of readers.
+ * @write_waiters:
+ *	The number of threads waiting to lock the chunk for writing. While
+ *	there are such threads, new readers are not allowed.
  * @state:
  *	Defines the state of a chunk. May contain CHUNK_ST_* bits.
  * @diff_buffer:
  *	Pointer to &struct diff_buffer. Describes a buffer in the memory
  *	for storing the chunk data.
  * @diff_region:
- *	Pointer to &struct diff_region. Describes a copy of the chunk data
- *	on the difference storage.
+ *	Describes a copy of the chunk data on the difference storage. The
+ *	region has not been allocated yet if its block device is NULL.
  * @diff_io:
  *	Provides I/O operations for a chunk.
+ * @share_next:
+ *	For a chunk being loaded from the original block device, the first
+ *	chunk of another snapshot that waits for the same data. For such a
+ *	waiting chunk, the next one in the list.
+ * @is_share_open:
+ *	The chunk is being loaded by the copy-on-write algorithm and the
+ *	chunks of other snapshots can wait for its data instead of reading
+ *	the original block device again.
+ * @dedup:
+ *	The entry of the deduplication index for the data being stored. It
+ *	is added to the index when the data has been written.
  *
  * This structure describes the block of data that the module operates
  * with when executing the copy-on-write algorithm and when performing I/O
@@ -85,10 +116,15 @@ enum chunk_st {
  * If the data of the chunk has been changed or has just been read, then
  * the chunk gets into cache.
  *
- * The semaphore is blocked for writing if there is no actual data in the
+ * The lock is locked for writing if there is no actual data in the
  * buffer, since a block of data is being read from the original device or
- * from a diff storage. If data is being read from or written to the
- * diff_buffer, the semaphore must be locked.
+ * from a diff storage. If data is being written to the diff_buffer, the
+ * lock must be locked for writing. Reading the data of a chunk whose buffer
+ * is ready can be performed by several threads at the same time.
+ *
+ * Unlike the rw_semaphore, the lock can be released by another thread or
+ * from the bio completion handler, since the chunk remains locked while
+ * the asynchronous I/O is being performed.
  */
 struct chunk {
 	struct list_head cache_link;
@@ -97,14 +133,56 @@ struct chunk {
 	unsigned long number;
 	sector_t sector_count;
 
-	struct semaphore lock;
+	atomic_t lock;
+	atomic_t write_waiters;
 
 	atomic_t state;
 	struct diff_buffer *diff_buffer;
-	struct diff_region *diff_region;
+	struct diff_region diff_region;
 	struct diff_io *diff_io;
+
+	struct chunk *share_next;
+	bool is_share_open;
+
+	struct diff_storage_dedup *dedup;
+};
+
+#define CHUNK_LOCK_WRITER (-1)
+
+static inline bool chunk_trylock_write(struct chunk *chunk)
+{
+	return atomic_cmpxchg(&chunk->lock, 0, CHUNK_LOCK_WRITER) == 0;
 };
 
+static inline bool chunk_trylock_read(struct chunk *chunk)
+{
+	int count = atomic_read(&chunk->lock);
+
+	do {
+		/* The writers take precedence over the readers. */
+		if ((count < 0) || atomic_read(&chunk->write_waiters))
+			return false;
+	} while (!atomic_try_cmpxchg(&chunk->lock, &count, count + 1));
+
+	return true;
+};
+
+static inline void chunk_unlock_write(struct chunk *chunk)
+{
+	WARN_ON(atomic_xchg(&chunk->lock, 0) != CHUNK_LOCK_WRITER);
+	wake_up_var(&chunk->lock);
+};
+
+static inline void chunk_unlock_read(struct chunk *chunk)
+{
+	if (atomic_dec_return(&chunk->lock) == 0)
+		wake_up_var(&chunk->lock);
+};
+
+void chunk_lock_write(struct chunk *chunk);
+int chunk_lock_write_killable(struct chunk *chunk);
+int chunk_lock_read_killable(struct chunk *chunk);
+
 static inline void chunk_state_set(struct chunk *chunk, int st)
 {
 	atomic_or(st, &chunk->state);
@@ -132,6 +210,9 @@ void chunk_schedule_caching(struct chunk *chunk);
 /* Asynchronous operations are used to implement the COW algorithm. */
 int chunk_async_store_diff(struct chunk *chunk, bool is_nowait);
 int chunk_async_load_orig(struct chunk *chunk, const bool is_nowait);
+int chunk_async_prefetch(struct chunk *chunk);
+void chunk_prefetch_complete(struct chunk *chunk);
+bool chunk_share_load(struct chunk *leader, struct chunk *chunk);
 
 /* Synchronous operations are used to implement reading and writing to the snapshot image. */
 int chunk_load_orig(struct chunk *chunk);
@@ -2,6 +2,7 @@
 #define pr_fmt(fmt) KBUILD_MODNAME "-ctrl: " fmt
 
 #include <linux/module.h>
+#include <linux/file.h>
 #include <linux/poll.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
@@ -51,6 +52,10 @@ static const struct blk_snap_mod modification = {
 #ifdef BLK_SNAP_FILELOG
 	(1ull << blk_snap_compat_flag_setlog) |
 #endif
+	(1ull << blk_snap_compat_flag_append_file) |
+	(1ull << blk_snap_compat_flag_storage_stat) |
+	(1ull << blk_snap_compat_flag_storage_usage) |
+	(1ull << blk_snap_compat_flag_event_fd) |
 	0
 };
 #endif
@@ -503,10 +508,123 @@ static int ioctl_get_sector_state(unsigned long arg)
 #endif
 }
 
+static int ioctl_snapshot_append_file(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_append_file karg;
+	struct file *file;
+	uuid_t id;
+
+	pr_debug("Append file to difference storage\n");
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to append file to difference storage: invalid user buffer\n");
+		return -EINVAL;
+	}
+
+	file = fget(karg.fd);
+	if (!file) {
+		pr_err("Unable to append file to difference storage: invalid file descriptor\n");
+		return -EBADF;
+	}
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_append_file(&id, file, karg.sector_count);
+	fput(file);
+
+	return ret;
+}
+
+static int ioctl_snapshot_storage_stat(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_storage_stat karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get difference storage statistics: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_get_storage_stat(&id, &karg);
+	if (ret)
+		return ret;
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get difference storage statistics: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_snapshot_storage_usage(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_storage_usage karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get difference storage usage: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_get_storage_usage(&id, &karg);
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get difference storage usage: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return ret;
+}
+
+static int ioctl_snapshot_event_fd(unsigned long arg)
+{
+	int fd;
+	struct blk_snap_snapshot_event_fd karg;
+	struct file *file;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to open event file: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	file = snapshot_event_file(&id);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		fput(file);
+		return fd;
+	}
+
+	/* The descriptor is installed only when the user has received it. */
+	karg.fd = fd;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to open event file: invalid user buffer\n");
+		put_unused_fd(fd);
+		fput(file);
+		return -ENODATA;
+	}
+
+	fd_install(fd, file);
+	return 0;
+}
+
 static int (*const blk_snap_ioctl_table_mod[])(unsigned long arg) = {
 	ioctl_mod,
 	ioctl_setlog,
 	ioctl_get_sector_state,
+	ioctl_snapshot_append_file,
+	ioctl_snapshot_storage_stat,
+	ioctl_snapshot_storage_usage,
+	ioctl_snapshot_event_fd,
 };
 static_assert(
 	sizeof(blk_snap_ioctl_table_mod) ==
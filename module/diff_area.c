@@ -5,6 +5,7 @@
 #endif
 #include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/highmem.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blk_snap.h"
 #else
@@ -93,28 +94,37 @@ static void diff_area_calculate_chunk_size(struct diff_area *diff_area)
 void diff_area_free(struct kref *kref)
 {
 	unsigned long inx = 0;
-	u64 start_waiting;
 	struct chunk *chunk;
 	struct diff_area *diff_area =
 		container_of(kref, struct diff_area, kref);
 
 	might_sleep();
-	start_waiting = jiffies_64;
-	while (atomic_read(&diff_area->pending_io_count)) {
-		schedule_timeout_interruptible(1);
-		if (jiffies_64 > (start_waiting + HZ)) {
-			start_waiting = jiffies_64;
-			inx++;
-			pr_warn("Waiting for pending I/O to complete\n");
-			if (inx > 5) {
-				pr_err("Failed to complete pending I/O\n");
-				break;
-			}
+	while (!wait_event_timeout(diff_area->io_wait,
+				   !atomic_read(&diff_area->pending_io_count),
+				   HZ)) {
+		inx++;
+		pr_warn("Waiting for pending I/O to complete\n");
+		if (inx > 5) {
+			pr_err("Failed to complete pending I/O\n");
+			break;
 		}
 	}
+	/* Wait for the last diff_area_io_end() to leave the wait queue. */
+	spin_lock_irq(&diff_area->io_wait.lock);
+	spin_unlock_irq(&diff_area->io_wait.lock);
+
+	if (diff_area->shrinker_registered) {
+		unregister_shrinker(&diff_area->shrinker);
+		diff_area->shrinker_registered = false;
+	}
 
 	atomic_set(&diff_area->corrupt_flag, 1);
-	flush_work(&diff_area->cache_release_work);
+	if (diff_area->cache_release_wq) {
+		flush_work(&diff_area->prefetch_work);
+		flush_work(&diff_area->cache_release_work);
+		destroy_workqueue(diff_area->cache_release_wq);
+		diff_area->cache_release_wq = NULL;
+	}
 	xa_for_each(&diff_area->chunk_map, inx, chunk)
 		chunk_free(chunk);
 	xa_destroy(&diff_area->chunk_map);
@@ -132,49 +142,63 @@ void diff_area_free(struct kref *kref)
 }
 
 static inline struct chunk *
-get_chunk_from_cache_and_write_lock(spinlock_t *caches_lock,
-				    struct list_head *cache_queue,
-				    atomic_t *cache_count)
+diff_area_pop_chunk_from_cache(spinlock_t *caches_lock,
+			       struct list_head *cache_queue,
+			       atomic_t *cache_count)
 {
-	struct chunk *iter;
-	struct chunk *chunk = NULL;
-#ifdef BLK_SNAP_DEBUG_DIFF_BUFFER
-	int locked_mutex_counter = 0;
-#endif
+	struct chunk *chunk;
+	unsigned long flags;
 
-	spin_lock(caches_lock);
-	list_for_each_entry(iter, cache_queue, cache_link) {
-		if (!down_trylock(&iter->lock)) {
-			chunk = iter;
-			break;
-		}
-		/*
-		 * If it is not possible to lock a chunk for writing,
-		 * then it is currently in use, and we try to clean up the
-		 * next chunk.
-		 */
-#ifdef BLK_SNAP_DEBUG_DIFF_BUFFER
-		locked_mutex_counter++;
-#endif
-	}
+	spin_lock_irqsave(caches_lock, flags);
+	chunk = list_first_entry_or_null(cache_queue, struct chunk, cache_link);
 	if (likely(chunk)) {
 		atomic_dec(cache_count);
 		list_del_init(&chunk->cache_link);
 	}
-	spin_unlock(caches_lock);
+	spin_unlock_irqrestore(caches_lock, flags);
 
+	return chunk;
+}
+
+/*
+ * The chunk is removed from the head of the cache queue under the spinlock,
+ * and only then its lock is taken. The chunk lock is never taken while
+ * holding the caches_lock, so busy chunks are not rescanned.
+ * While waiting for the lock, the chunk could be used by someone else.
+ * If after that the chunk has returned to the cache, then it has become
+ * "hot" again and should not be released. If its buffer has already been
+ * released or stored, then there is nothing to do with it.
+ */
+static inline struct chunk *
+get_chunk_from_cache_and_write_lock(spinlock_t *caches_lock,
+				    struct list_head *cache_queue,
+				    atomic_t *cache_count)
+{
+	struct chunk *chunk;
+
+	while ((chunk = diff_area_pop_chunk_from_cache(caches_lock, cache_queue,
+						       cache_count))) {
+		chunk_lock_write(chunk);
+
+		if (list_empty(&chunk->cache_link) &&
+		    chunk_state_check(chunk, CHUNK_ST_BUFFER_READY))
+			return chunk;
 #ifdef BLK_SNAP_DEBUG_DIFF_BUFFER
-	if (locked_mutex_counter)
-		pr_debug("Found %d locked chunk\n", locked_mutex_counter);
+		pr_debug("Chunk #%ld was used while waiting for the lock\n",
+			 chunk->number);
 #endif
-	return chunk;
+		chunk_unlock_write(chunk);
+	}
+
+	return NULL;
 }
 
 static struct chunk *
 diff_area_get_chunk_from_cache_and_write_lock(struct diff_area *diff_area)
 {
-	if (atomic_read(&diff_area->read_cache_count) >
-	    chunk_maximum_in_cache) {
+	if ((atomic_read(&diff_area->read_cache_count) >
+	     chunk_maximum_in_cache) &&
+	    !diff_buffer_memory_plentiful()) {
 		struct chunk *chunk = get_chunk_from_cache_and_write_lock(
 			&diff_area->caches_lock, &diff_area->read_cache_queue,
 			&diff_area->read_cache_count);
@@ -189,7 +213,7 @@ diff_area_get_chunk_from_cache_and_write_lock(struct diff_area *diff_area)
 	}
 
 	if (atomic_read(&diff_area->write_cache_count) >
-	    chunk_maximum_in_cache) {
+	    diff_area_write_cache_low()) {
 		struct chunk *chunk = get_chunk_from_cache_and_write_lock(
 			&diff_area->caches_lock, &diff_area->write_cache_queue,
 			&diff_area->write_cache_count);
@@ -210,24 +234,19 @@ diff_area_get_chunk_from_cache_and_write_lock(struct diff_area *diff_area)
 	return NULL;
 }
 
+/*
+ * The chunks of the write cache are stored in a batch, so the write requests
+ * are plugged to let the block layer merge them.
+ */
 static void diff_area_cache_release(struct diff_area *diff_area)
 {
 	struct chunk *chunk;
+	struct blk_plug plug;
 
+	blk_start_plug(&plug);
 	while (!diff_area_is_corrupted(diff_area) &&
 	       (chunk = diff_area_get_chunk_from_cache_and_write_lock(
 			diff_area))) {
-		/*
-		 * There cannot be a chunk in the cache whose buffer is
-		 * not ready.
-		 */
-		if (WARN(!chunk_state_check(chunk, CHUNK_ST_BUFFER_READY),
-			 "Cannot release empty buffer for chunk #%ld",
-			 chunk->number)) {
-			up(&chunk->lock);
-			continue;
-		}
-
 		if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
 			int ret;
 
@@ -248,9 +267,31 @@ static void diff_area_cache_release(struct diff_area *diff_area)
 				 chunk->number);
 #endif
 			chunk_diff_buffer_release(chunk);
-			up(&chunk->lock);
+			chunk_unlock_write(chunk);
 		}
 	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * The number of chunks in the write cache at which the cache release starts
+ * storing them. If the RAM tier is enabled, its high watermark is used.
+ */
+int diff_area_write_cache_high(void)
+{
+	return max(chunk_ram_tier_high, chunk_maximum_in_cache);
+}
+
+/*
+ * The number of chunks that remain in the write cache after the cache
+ * release. If the RAM tier is enabled, its low watermark is used.
+ */
+int diff_area_write_cache_low(void)
+{
+	if (chunk_ram_tier_high <= chunk_maximum_in_cache)
+		return chunk_maximum_in_cache;
+
+	return clamp(chunk_ram_tier_low, 0, chunk_ram_tier_high);
 }
 
 static void diff_area_cache_release_work(struct work_struct *work)
@@ -261,6 +302,135 @@ static void diff_area_cache_release_work(struct work_struct *work)
 	diff_area_cache_release(diff_area);
 }
 
+/*
+ * The prefetched chunks are decompressed here, since it cannot be done in
+ * the I/O completion handler.
+ */
+static void diff_area_prefetch_work(struct work_struct *work)
+{
+	struct diff_area *diff_area =
+		container_of(work, struct diff_area, prefetch_work);
+	struct chunk *chunk;
+
+	while (true) {
+		spin_lock_irq(&diff_area->caches_lock);
+		chunk = list_first_entry_or_null(&diff_area->prefetch_queue,
+						 struct chunk, cache_link);
+		if (chunk)
+			list_del_init(&chunk->cache_link);
+		spin_unlock_irq(&diff_area->caches_lock);
+		if (!chunk)
+			break;
+
+		chunk_prefetch_complete(chunk);
+	}
+}
+
+static inline unsigned long diff_area_chunk_pages(struct diff_area *diff_area)
+{
+	return round_up(diff_area_chunk_sectors(diff_area), PAGE_SECTORS) /
+	       PAGE_SECTORS;
+}
+
+/*
+ * The shrinker counts objects in pages. This allows the memory management
+ * subsystem to balance the release of chunk buffers with other caches.
+ */
+static unsigned long diff_area_shrink_count(struct shrinker *shrinker,
+					    struct shrink_control *sc)
+{
+	struct diff_area *diff_area =
+		container_of(shrinker, struct diff_area, shrinker);
+	unsigned long count;
+
+	if (diff_area_is_corrupted(diff_area))
+		return 0;
+
+	count = atomic_read(&diff_area->read_cache_count) +
+		atomic_read(&diff_area->free_diff_buffers_count);
+	if (!count)
+		return SHRINK_EMPTY;
+
+	return count * diff_area_chunk_pages(diff_area);
+}
+
+/*
+ * First of all, the free buffers from the pool are released. Then the clean
+ * chunks from the head of the read cache release their buffers. Dirty
+ * chunks are not touched, since their data has not yet been stored.
+ */
+static unsigned long diff_area_shrink_scan(struct shrinker *shrinker,
+					   struct shrink_control *sc)
+{
+	struct diff_area *diff_area =
+		container_of(shrinker, struct diff_area, shrinker);
+	unsigned long freed = 0;
+
+	while (freed < sc->nr_to_scan) {
+		unsigned long flags;
+		unsigned long released;
+		struct chunk *chunk;
+
+		if (diff_area_is_corrupted(diff_area))
+			break;
+
+		released = diff_buffer_pool_shrink(diff_area);
+		if (released) {
+			freed += released;
+			continue;
+		}
+
+		/*
+		 * The shrinker cannot wait for the chunk lock. Only the
+		 * head of the read cache is checked. If it is busy, then
+		 * the scan is stopped.
+		 */
+		spin_lock_irqsave(&diff_area->caches_lock, flags);
+		chunk = list_first_entry_or_null(&diff_area->read_cache_queue,
+						 struct chunk, cache_link);
+		if (chunk && chunk_trylock_write(chunk)) {
+			atomic_dec(&diff_area->read_cache_count);
+			list_del_init(&chunk->cache_link);
+		} else
+			chunk = NULL;
+		spin_unlock_irqrestore(&diff_area->caches_lock, flags);
+		if (!chunk)
+			break;
+
+		if (chunk_state_check(chunk, CHUNK_ST_BUFFER_READY) &&
+		    !chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
+			chunk_diff_buffer_release(chunk);
+			freed += diff_area_chunk_pages(diff_area);
+		}
+		chunk_unlock_write(chunk);
+	}
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static int diff_area_register_shrinker(struct diff_area *diff_area)
+{
+	int ret;
+
+	diff_area->shrinker.count_objects = diff_area_shrink_count;
+	diff_area->shrinker.scan_objects = diff_area_shrink_scan;
+	diff_area->shrinker.seeks = DEFAULT_SEEKS;
+#ifdef HAVE_REGISTER_SHRINKER_NAME
+	ret = register_shrinker(&diff_area->shrinker, "blksnap-diff-area-%u:%u",
+				MAJOR(diff_area->orig_bdev->bd_dev),
+				MINOR(diff_area->orig_bdev->bd_dev));
+#else
+	ret = register_shrinker(&diff_area->shrinker);
+#endif
+	if (ret) {
+		pr_err("Failed to register shrinker. errno=%d\n", abs(ret));
+		return ret;
+	}
+
+	diff_area->shrinker_registered = true;
+	return 0;
+}
+
 struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 {
 	int ret = 0;
@@ -293,6 +463,7 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 	pr_debug("Chunk count %lu\n", diff_area->chunk_count);
 
 	kref_init(&diff_area->kref);
+	INIT_LIST_HEAD(&diff_area->tracker_link);
 	xa_init(&diff_area->chunk_map);
 
 	if (!diff_storage->capacity) {
@@ -313,13 +484,30 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 	INIT_LIST_HEAD(&diff_area->write_cache_queue);
 	atomic_set(&diff_area->write_cache_count, 0);
 	INIT_WORK(&diff_area->cache_release_work, diff_area_cache_release_work);
-
-	spin_lock_init(&diff_area->free_diff_buffers_lock);
-	INIT_LIST_HEAD(&diff_area->free_diff_buffers);
-	atomic_set(&diff_area->free_diff_buffers_count, 0);
+	INIT_LIST_HEAD(&diff_area->prefetch_queue);
+	INIT_WORK(&diff_area->prefetch_work, diff_area_prefetch_work);
 
 	atomic_set(&diff_area->corrupt_flag, 0);
+	atomic64_set(&diff_area->stored_sectors, 0);
+	atomic64_set(&diff_area->region_count, 0);
 	atomic_set(&diff_area->pending_io_count, 0);
+	atomic_set(&diff_area->image_io_count, 0);
+	init_waitqueue_head(&diff_area->io_wait);
+
+	ret = diff_buffer_pool_init(diff_area);
+	if (ret) {
+		diff_area_put(diff_area);
+		return ERR_PTR(ret);
+	}
+
+	diff_area->cache_release_wq =
+		alloc_workqueue("blksnap-cache-%u:%u",
+				WQ_UNBOUND | WQ_MEM_RECLAIM, 1,
+				MAJOR(dev_id), MINOR(dev_id));
+	if (!diff_area->cache_release_wq) {
+		diff_area_put(diff_area);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	/**
 	 * Allocating all chunks in advance allows to avoid doing this in
@@ -353,6 +541,12 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 
 	recalculate_last_chunk_size(chunk);
 
+	ret = diff_area_register_shrinker(diff_area);
+	if (ret) {
+		diff_area_put(diff_area);
+		return ERR_PTR(ret);
+	}
+
 	atomic_set(&diff_area->corrupt_flag, 0);
 
 	return diff_area;
@@ -361,7 +555,9 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 static void diff_area_take_chunk_from_cache(struct diff_area *diff_area,
 					    struct chunk *chunk)
 {
-	spin_lock(&diff_area->caches_lock);
+	unsigned long flags;
+
+	spin_lock_irqsave(&diff_area->caches_lock, flags);
 	if (!list_is_first(&chunk->cache_link, &chunk->cache_link)) {
 		list_del_init(&chunk->cache_link);
 
@@ -374,20 +570,49 @@ static void diff_area_take_chunk_from_cache(struct diff_area *diff_area,
 		} else
 			atomic_dec(&diff_area->read_cache_count);
 	}
-	spin_unlock(&diff_area->caches_lock);
+	spin_unlock_irqrestore(&diff_area->caches_lock, flags);
+}
+
+/*
+ * The chunks of the older snapshots that need to be copied contain the same
+ * data as the chunk of the newest snapshot, since the original block device
+ * has not changed since the older snapshots were taken. If the chunk sizes
+ * are equal, the data is read from the original block device only once and
+ * is shared between the snapshots.
+ */
+static inline struct chunk *diff_area_share_leader(struct diff_area *diff_area,
+						   struct diff_area *leader,
+						   unsigned long number)
+{
+	if (!leader || (leader == diff_area) ||
+	    (leader->chunk_shift != diff_area->chunk_shift) ||
+	    diff_area_is_corrupted(leader))
+		return NULL;
+
+	return xa_load(&leader->chunk_map, number);
 }
 
 /**
  * diff_area_copy() - Implements the copy-on-write mechanism.
- *
- *
+ * @diff_area:
+ *	The difference area of the snapshot.
+ * @leader:
+ *	The difference area of the newest snapshot of the device or NULL.
+ *	The chunks that are being loaded for it are shared.
+ * @sector:
+ *	The first sector of the write request.
+ * @count:
+ *	The number of sectors in the write request.
+ * @is_nowait:
+ *	The request should not wait.
  */
-int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
-		   const bool is_nowait)
+int diff_area_copy(struct diff_area *diff_area, struct diff_area *leader,
+		   sector_t sector, sector_t count, const bool is_nowait)
 {
 	int ret = 0;
 	sector_t offset;
 	struct chunk *chunk;
+	struct chunk *leader_chunk;
 	struct diff_buffer *diff_buffer;
 	sector_t area_sect_first;
 	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
@@ -403,10 +628,10 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 		}
 		WARN_ON(chunk_number(diff_area, offset) != chunk->number);
 		if (is_nowait) {
-			if (down_trylock(&chunk->lock))
+			if (!chunk_trylock_write(chunk))
 				return -EAGAIN;
 		} else {
-			ret = down_killable(&chunk->lock);
+			ret = chunk_lock_write_killable(chunk);
 			if (unlikely(ret))
 				return ret;
 		}
@@ -419,7 +644,7 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 			 * - Overwritten in the snapshot image
 			 * - Already stored in the diff storage
 			 */
-			up(&chunk->lock);
+			chunk_unlock_write(chunk);
 			continue;
 		}
 
@@ -449,6 +674,11 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 			WARN(chunk->diff_buffer, "Chunks buffer has been lost");
 			chunk->diff_buffer = diff_buffer;
 
+			leader_chunk = diff_area_share_leader(diff_area, leader,
+							      chunk->number);
+			if (leader_chunk && chunk_share_load(leader_chunk, chunk))
+				continue;
+
 			ret = chunk_async_load_orig(chunk, is_nowait);
 			if (unlikely(ret))
 				goto fail_unlock_chunk;
@@ -481,11 +711,15 @@ int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 			return -EINVAL;
 		}
 		WARN_ON(chunk_number(diff_area, offset) != chunk->number);
+		/*
+		 * Waiting does not change the chunk, so several threads can
+		 * wait for the same chunk at the same time.
+		 */
 		if (is_nowait) {
-			if (down_trylock(&chunk->lock))
+			if (!chunk_trylock_read(chunk))
 				return -EAGAIN;
 		} else {
-			ret = down_killable(&chunk->lock);
+			ret = chunk_lock_read_killable(chunk);
 			if (unlikely(ret))
 				return ret;
 		}
@@ -497,7 +731,7 @@ int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 			 * - Overwritten in the snapshot image
 			 * - Already stored in the diff storage
 			 */
-			up(&chunk->lock);
+			chunk_unlock_read(chunk);
 			ret = -EFAULT;
 			break;
 		}
@@ -510,16 +744,47 @@ int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 			 * - Overwritten in the snapshot image
 			 * - Already stored in the diff storage
 			 */
-			up(&chunk->lock);
+			chunk_unlock_read(chunk);
 			continue;
 		}
+
+		/* The read lock should not be leaked even for a pure chunk. */
+		chunk_unlock_read(chunk);
 	}
 
 	return ret;
 }
 
-static inline void diff_area_image_put_chunk(struct chunk *chunk, bool is_write)
+/*
+ * The chunk locked for reading remains in the cache. It is moved to the
+ * tail of the cache queue, since it was recently used.
+ */
+static void diff_area_touch_chunk_in_cache(struct diff_area *diff_area,
+					   struct chunk *chunk)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&diff_area->caches_lock, flags);
+	if (!list_empty(&chunk->cache_link)) {
+		if (chunk_state_check(chunk, CHUNK_ST_DIRTY))
+			list_move_tail(&chunk->cache_link,
+				       &diff_area->write_cache_queue);
+		else
+			list_move_tail(&chunk->cache_link,
+				       &diff_area->read_cache_queue);
+	}
+	spin_unlock_irqrestore(&diff_area->caches_lock, flags);
+}
+
+static inline void diff_area_image_put_chunk(struct chunk *chunk, bool is_write,
+					     bool is_shared)
 {
+	if (is_shared) {
+		diff_area_touch_chunk_in_cache(chunk->diff_area, chunk);
+		chunk_unlock_read(chunk);
+		return;
+	}
+
 	if (is_write) {
 		/*
 		 * Since the chunk was taken to perform writing,
@@ -539,11 +804,13 @@ void diff_area_image_ctx_done(struct diff_area_image_ctx *io_ctx)
 	if (!io_ctx->chunk)
 		return;
 
-	diff_area_image_put_chunk(io_ctx->chunk, io_ctx->is_write);
+	diff_area_image_put_chunk(io_ctx->chunk, io_ctx->is_write,
+				  io_ctx->is_chunk_shared);
+	io_ctx->chunk = NULL;
 }
 
-static int diff_area_load_chunk_from_storage(struct diff_area *diff_area,
-					     struct chunk *chunk)
+static int diff_area_take_chunk_buffer(struct diff_area *diff_area,
+				       struct chunk *chunk)
 {
 	struct diff_buffer *diff_buffer;
 
@@ -553,15 +820,54 @@ static int diff_area_load_chunk_from_storage(struct diff_area *diff_area,
 
 	WARN_ON(chunk->diff_buffer);
 	chunk->diff_buffer = diff_buffer;
+	return 0;
+}
+
+static int diff_area_load_chunk_from_storage(struct diff_area *diff_area,
+					     struct chunk *chunk)
+{
+	int ret;
+
+	ret = diff_area_take_chunk_buffer(diff_area, chunk);
+	if (ret)
+		return ret;
 
 	if (chunk_state_check(chunk, CHUNK_ST_STORE_READY)) {
 #ifdef BLK_SNAP_DEBUG_IMAGE_WRITE
 		pr_debug("Read chunk #%lu from diff storage", chunk->number);
 #endif
-		return chunk_load_diff(chunk);
+		diff_area_io_start(diff_area, true);
+		ret = chunk_load_diff(chunk);
+	} else {
+		diff_area_io_start(diff_area, true);
+		ret = chunk_load_orig(chunk);
 	}
+	diff_area_io_end(diff_area, true);
+
+	return ret;
+}
 
-	return chunk_load_orig(chunk);
+static inline bool
+diff_area_image_overwrites_chunk(struct diff_area_image_ctx *io_ctx,
+				 struct chunk *chunk, sector_t sector)
+{
+	return io_ctx->is_write && (sector == chunk_sector(chunk)) &&
+	       (io_ctx->write_end >= (sector + chunk->sector_count));
+}
+
+/*
+ * If writing to a chunk that was not loaded fails, then the buffer contains
+ * garbage and must be discarded. The chunk will be loaded again on the next
+ * access.
+ */
+static void diff_area_image_discard_chunk(struct diff_area_image_ctx *io_ctx)
+{
+	struct chunk *chunk = io_ctx->chunk;
+
+	chunk_diff_buffer_release(chunk);
+	chunk_unlock_write(chunk);
+	io_ctx->chunk = NULL;
+	io_ctx->is_chunk_unloaded = false;
 }
 
 static struct chunk *
@@ -582,8 +888,10 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 		 * If the sector falls into a new chunk, then we release
 		 * the old chunk.
 		 */
-		diff_area_image_put_chunk(chunk, io_ctx->is_write);
+		diff_area_image_put_chunk(chunk, io_ctx->is_write,
+					  io_ctx->is_chunk_shared);
 		io_ctx->chunk = NULL;
+		io_ctx->is_chunk_unloaded = false;
 	}
 
 	/* Take a next chunk. */
@@ -591,9 +899,28 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 	if (unlikely(!chunk))
 		return ERR_PTR(-EINVAL);
 
-	ret = down_killable(&chunk->lock);
+	/*
+	 * If the chunk data is already in the buffer, then it can be read
+	 * by several threads at the same time. The chunk remains in the cache.
+	 */
+	if (!io_ctx->is_write) {
+		ret = chunk_lock_read_killable(chunk);
+		if (ret)
+			return ERR_PTR(ret);
+
+		if (chunk_state_check(chunk, CHUNK_ST_BUFFER_READY) &&
+		    !chunk_state_check(chunk, CHUNK_ST_FAILED)) {
+			io_ctx->chunk = chunk;
+			io_ctx->is_chunk_shared = true;
+			return chunk;
+		}
+		chunk_unlock_read(chunk);
+	}
+
+	ret = chunk_lock_write_killable(chunk);
 	if (ret)
 		return ERR_PTR(ret);
+	io_ctx->is_chunk_shared = false;
 
 	if (unlikely(chunk_state_check(chunk, CHUNK_ST_FAILED))) {
 		pr_err("Chunk #%ld corrupted\n", chunk->number);
@@ -613,7 +940,19 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 	 * Otherwise, the chunk needs to be loaded from the original device or
 	 * from the difference storage.
 	 */
-	if (!chunk_state_check(chunk, CHUNK_ST_BUFFER_READY)) {
+	if (!chunk_state_check(chunk, CHUNK_ST_BUFFER_READY) &&
+	    diff_area_image_overwrites_chunk(io_ctx, chunk, sector)) {
+		ret = diff_area_take_chunk_buffer(diff_area, chunk);
+		if (unlikely(ret))
+			goto fail_unlock_chunk;
+
+		/*
+		 * The data of the chunk will be overwritten completely,
+		 * so there is no need to load it.
+		 */
+		chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+		io_ctx->is_chunk_unloaded = true;
+	} else if (!chunk_state_check(chunk, CHUNK_ST_BUFFER_READY)) {
 		ret = diff_area_load_chunk_from_storage(diff_area, chunk);
 		if (unlikely(ret))
 			goto fail_unlock_chunk;
@@ -628,7 +967,7 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 
 fail_unlock_chunk:
 	pr_err("Failed to load chunk #%ld\n", chunk->number);
-	up(&chunk->lock);
+	chunk_unlock_write(chunk);
 	return ERR_PTR(ret);
 }
 
@@ -678,8 +1017,11 @@ blk_status_t diff_area_image_io(struct diff_area_image_ctx *io_ctx,
 					diff_buffer_iter.offset,
 					diff_buffer_iter.bytes,
 					&iter);
-			if (!sz)
+			if (!sz) {
+				if (io_ctx->is_chunk_unloaded)
+					diff_area_image_discard_chunk(io_ctx);
 				return BLK_STS_IOERR;
+			}
 
 			buff_offset += sz;
 			*pos += (sz >> SECTOR_SHIFT);
@@ -690,6 +1032,242 @@ blk_status_t diff_area_image_io(struct diff_area_image_ctx *io_ctx,
 	return BLK_STS_OK;
 }
 
+/**
+ * struct diff_area_redirect - The context of a bio redirected to the original
+ *	block device or to the difference storage.
+ * @chunk:
+ *	The chunk locked for reading until the completion of the bio. This
+ *	prevents the copy-on-write of the chunk and the release of its
+ *	region in the difference storage while reading.
+ * @orig_bio:
+ *	The bio of the snapshot image.
+ * @bio:
+ *	The clone of the snapshot image bio.
+ */
+struct diff_area_redirect {
+	struct chunk *chunk;
+	struct bio *orig_bio;
+	struct bio bio;
+};
+
+static struct bio_set diff_area_redirect_bioset;
+
+static void diff_area_redirect_endio(struct bio *bio)
+{
+	struct diff_area_redirect *redirect =
+		container_of(bio, struct diff_area_redirect, bio);
+	struct bio *orig_bio = redirect->orig_bio;
+	struct chunk *chunk = redirect->chunk;
+
+	if (bio->bi_status != BLK_STS_OK)
+		orig_bio->bi_status = bio->bi_status;
+
+	chunk_unlock_read(chunk);
+	diff_area_io_end(chunk->diff_area, true);
+
+	bio_put(bio);
+	bio_endio(orig_bio);
+}
+
+/*
+ * If the chunk has never been touched, then its data is read directly from
+ * the original block device. If the chunk has been stored and its data is
+ * not in the memory, then the data is read directly from its region in the
+ * difference storage. Neither a buffer nor copying are required. The
+ * compressed chunks are always read through the buffer. The part of the bio
+ * that falls on a chunk of zeros is filled in with zeros.
+ * Returns -EAGAIN if the chunk data should be read from its buffer.
+ */
+static int diff_area_image_redirect(struct diff_area *diff_area,
+				    struct bio *orig_bio,
+				    struct bvec_iter *iter, unsigned int len)
+{
+	int ret;
+	int state;
+	struct chunk *chunk;
+	struct bio *bio;
+	struct diff_area_redirect *redirect;
+	struct block_device *bdev;
+	sector_t sector;
+
+	chunk = xa_load(&diff_area->chunk_map,
+			chunk_number(diff_area, iter->bi_sector));
+	if (unlikely(!chunk))
+		return -EINVAL;
+
+	ret = chunk_lock_read_killable(chunk);
+	if (ret)
+		return ret;
+
+	state = atomic_read(&chunk->state);
+	if (state == (CHUNK_ST_STORE_READY | CHUNK_ST_ZERO)) {
+		struct bvec_iter part = *iter;
+		struct bvec_iter seg_iter;
+		struct bio_vec bvec;
+
+		part.bi_size = len;
+		__bio_for_each_segment(bvec, orig_bio, seg_iter, part)
+			zero_user(bvec.bv_page, bvec.bv_offset, bvec.bv_len);
+
+		chunk_unlock_read(chunk);
+		return 0;
+	}
+
+	if (!state) {
+		bdev = diff_area->orig_bdev;
+		sector = iter->bi_sector;
+	} else if ((state == CHUNK_ST_STORE_READY) && chunk->diff_region.bdev) {
+		bdev = chunk->diff_region.bdev;
+		sector = chunk->diff_region.sector +
+			 (iter->bi_sector - chunk_sector(chunk));
+	} else {
+		chunk_unlock_read(chunk);
+		return -EAGAIN;
+	}
+
+#ifdef HAVE_BIO_ALLOC_CLONE
+	bio = bio_alloc_clone(bdev, orig_bio, GFP_NOIO,
+			      &diff_area_redirect_bioset);
+#else
+	bio = bio_clone_fast(orig_bio, GFP_NOIO, &diff_area_redirect_bioset);
+#endif
+	if (unlikely(!bio)) {
+		chunk_unlock_read(chunk);
+		return -ENOMEM;
+	}
+#ifndef HAVE_BIO_ALLOC_CLONE
+	bio_set_dev(bio, bdev);
+#endif
+#ifndef STANDALONE_BDEVFILTER
+	bio_set_flag(bio, BIO_FILTERED);
+#endif
+	bio->bi_iter = *iter;
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_iter.bi_size = len;
+	bio->bi_end_io = diff_area_redirect_endio;
+
+	redirect = container_of(bio, struct diff_area_redirect, bio);
+	redirect->chunk = chunk;
+	redirect->orig_bio = orig_bio;
+
+	diff_area_io_start(diff_area, true);
+	bio_inc_remaining(orig_bio);
+	submit_bio_noacct(bio);
+	return 0;
+}
+
+/**
+ * diff_area_image_read() - Reads a bio from the snapshot image.
+ *
+ * The bio is processed in parts that fit into the chunks. The parts that fall
+ * on untouched chunks are redirected to the original block device, and the
+ * parts that fall on stored chunks are redirected to the difference storage.
+ * The rest are copied from the chunk buffers.
+ * The bio is completed when all redirected parts are completed, so the caller
+ * must call bio_endio() anyway.
+ */
+blk_status_t diff_area_image_read(struct diff_area_image_ctx *io_ctx,
+				  struct bio *bio)
+{
+	struct diff_area *diff_area = io_ctx->diff_area;
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+	struct bvec_iter iter = bio->bi_iter;
+
+	while (iter.bi_size) {
+		sector_t pos = iter.bi_sector;
+		sector_t chunk_end = round_down(pos, chunk_sectors) +
+				     chunk_sectors;
+		unsigned int len;
+		int ret;
+
+		len = min_t(sector_t, iter.bi_size >> SECTOR_SHIFT,
+			    chunk_end - pos) << SECTOR_SHIFT;
+
+		ret = diff_area_image_redirect(diff_area, bio, &iter, len);
+		if (ret == -EAGAIN) {
+			struct bvec_iter part = iter;
+			struct bvec_iter seg_iter;
+			struct bio_vec bvec;
+
+			part.bi_size = len;
+			__bio_for_each_segment(bvec, bio, seg_iter, part) {
+				blk_status_t st;
+
+				st = diff_area_image_io(io_ctx, &bvec, &pos);
+				if (unlikely(st != BLK_STS_OK))
+					return st;
+			}
+			/*
+			 * The chunk is released so as not to hold it while
+			 * the next parts are being redirected.
+			 */
+			diff_area_image_ctx_done(io_ctx);
+		} else if (unlikely(ret))
+			return BLK_STS_IOERR;
+
+		bio_advance_iter(bio, &iter, len);
+	}
+
+	return BLK_STS_OK;
+}
+
+/**
+ * diff_area_prefetch_chunk() - Starts asynchronous loading of a chunk into
+ *	the read cache.
+ *
+ * Only the compressed chunks are prefetched. The untouched chunks and the
+ * stored uncompressed chunks are read by redirecting the bio to the original
+ * block device or to the difference storage, so there is no point in copying
+ * them into the buffer. The chunk is skipped if it is busy or if a buffer for
+ * it cannot be allocated without waiting.
+ */
+void diff_area_prefetch_chunk(struct diff_area *diff_area,
+			      unsigned long number)
+{
+	struct chunk *chunk;
+	struct diff_buffer *diff_buffer;
+
+	if (diff_area_is_corrupted(diff_area))
+		return;
+
+	chunk = xa_load(&diff_area->chunk_map, number);
+	if (unlikely(!chunk))
+		return;
+
+	if (!chunk_trylock_write(chunk))
+		return;
+
+	if (atomic_read(&chunk->state) !=
+	    (CHUNK_ST_STORE_READY | CHUNK_ST_COMPRESSED))
+		goto out_unlock;
+
+	diff_buffer = diff_buffer_take(diff_area, true);
+	if (IS_ERR(diff_buffer))
+		goto out_unlock;
+
+	WARN_ON(chunk->diff_buffer);
+	chunk->diff_buffer = diff_buffer;
+
+	if (!chunk_async_prefetch(chunk))
+		return;
+
+	chunk_diff_buffer_release(chunk);
+out_unlock:
+	chunk_unlock_write(chunk);
+}
+
+int diff_area_init(void)
+{
+	return bioset_init(&diff_area_redirect_bioset, 64,
+			   offsetof(struct diff_area_redirect, bio),
+			   BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
+}
+
+void diff_area_done(void)
+{
+	bioset_exit(&diff_area_redirect_bioset);
+}
+
 static inline void diff_area_event_corrupted(struct diff_area *diff_area,
 					     int err_code)
 {
@@ -699,7 +1277,7 @@ static inline void diff_area_event_corrupted(struct diff_area *diff_area,
 		.err_code = abs(err_code),
 	};
 
-	event_gen(&diff_area->diff_storage->event_queue, GFP_NOIO,
+	event_gen(diff_area->diff_storage->event_queue, GFP_NOIO,
 		  blk_snap_event_code_corrupted, &data,
 		  sizeof(struct blk_snap_event_corrupted));
 }
@@ -716,16 +1294,56 @@ void diff_area_set_corrupted(struct diff_area *diff_area, int err_code)
 	       MINOR(diff_area->orig_bdev->bd_dev), abs(err_code));
 }
 
+/*
+ * Decrements the counters under the lock of the wait queue, so that
+ * diff_area_free() cannot release the diff area between the decrement and
+ * the wake-up. Can be called from the bio completion handler.
+ */
+void diff_area_io_end(struct diff_area *diff_area, const bool is_image)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&diff_area->io_wait.lock, flags);
+	if (is_image)
+		atomic_dec(&diff_area->image_io_count);
+	atomic_dec(&diff_area->pending_io_count);
+	wake_up_locked(&diff_area->io_wait);
+	spin_unlock_irqrestore(&diff_area->io_wait.lock, flags);
+}
+
+/*
+ * While there are no copy-on-write operations, the snapshot image is not
+ * limited. Otherwise, the ratio of the image I/O operations to the
+ * copy-on-write ones should not exceed the ratio of their weights. At
+ * least one image I/O operation is always allowed, so the image is slowed
+ * down, but never stopped.
+ */
+static inline bool diff_area_image_io_allowed(struct diff_area *diff_area)
+{
+	int image_io = atomic_read(&diff_area->image_io_count);
+	int cow_io = atomic_read(&diff_area->pending_io_count) - image_io;
+
+	if (cow_io <= 0)
+		return true;
+
+	return (u64)image_io * max(cow_io_weight, 1) <
+	       (u64)cow_io * max(image_io_weight, 1);
+}
+
 void diff_area_throttling_io(struct diff_area *diff_area)
 {
-	u64 start_waiting;
+	might_sleep();
 
-	start_waiting = jiffies_64;
-	while (atomic_read(&diff_area->pending_io_count)) {
-		schedule_timeout_interruptible(0);
-		if (jiffies_64 > (start_waiting + HZ / 10))
-			break;
-	}
+	if (likely(diff_area_image_io_allowed(diff_area)))
+		return;
+
+	/*
+	 * The waiting time is limited, so that a continuous flow of
+	 * copy-on-write operations cannot starve the snapshot image.
+	 */
+	wait_event_timeout(diff_area->io_wait,
+			   diff_area_image_io_allowed(diff_area),
+			   msecs_to_jiffies(max(image_io_max_wait, 1)));
 }
 
 #ifdef BLK_SNAP_DEBUG_SECTOR_STATE
@@ -741,9 +1359,9 @@ int diff_area_get_sector_state(struct diff_area *diff_area, sector_t sector,
 		return -EINVAL;
 
 	WARN_ON(chunk_number(diff_area, offset) != chunk->number);
-	down(&chunk->lock);
+	chunk_lock_write(chunk);
 	*chunk_state = atomic_read(&chunk->state);
-	up(&chunk->lock);
+	chunk_unlock_write(chunk);
 
 	return 0;
 }
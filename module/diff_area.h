@@ -9,9 +9,12 @@
 #include <linux/spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/xarray.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
 #include "event_queue.h"
 
 struct diff_storage;
+struct diff_buffer_pcp;
 struct chunk;
 
 /**
@@ -19,6 +22,9 @@ struct chunk;
  * @kref:
  *	The reference counter. The &struct diff_area can be shared between
  *	the &struct tracker and &struct snapimage.
+ * @tracker_link:
+ *	The list header allows to link the difference areas of all snapshots
+ *	of the original block device to its tracker.
  * @orig_bdev:
  *	A pointer to the structure of an opened block device.
  * @diff_storage:
@@ -36,18 +42,32 @@ struct chunk;
  *	stored in RAM.
  * @caches_lock:
  *	This spinlock guarantees consistency of the linked lists of chunk
- *	caches.
+ *	caches. A stored chunk is put in the cache from the bio completion
+ *	handler, so the lock is taken with interrupts disabled.
  * @read_cache_queue:
  *	Queue for the read cache.
  * @read_cache_count:
  *	The number of chunks in the read cache.
  * @write_cache_queue:
- *	Queue for the write cache.
+ *	Queue for the write cache. The chunks changed in the snapshot image
+ *	and, if the RAM tier is enabled, the chunks copied from the original
+ *	block device wait in it to be stored in the difference storage.
  * @write_cache_count:
  *	The number of chunks in the write cache.
  * @cache_release_work:
  *	The workqueue work item. This worker limits the number of chunks
  *	that store their data in RAM.
+ * @prefetch_queue:
+ *	Queue of the prefetched compressed chunks waiting to be decompressed.
+ *	It is protected by the caches_lock.
+ * @prefetch_work:
+ *	The workqueue work item. This worker decompresses the prefetched
+ *	chunks and puts them in the read cache.
+ * @cache_release_wq:
+ *	The workqueue of the diff area on which the cache release worker is
+ *	executed. Unlike the system workqueue, it does not compete with
+ *	other work items and is guaranteed to make progress under memory
+ *	pressure.
  * @free_diff_buffers_lock:
  *	This spinlock guarantees consistency of the linked lists of
  *	free difference buffers.
@@ -55,7 +75,17 @@ struct chunk;
  *	Linked list of free difference buffers allows to reduce the number
  *	of buffer allocation and release operations.
  * @free_diff_buffers_count:
- *	The number of free difference buffers in the linked list.
+ *	The number of free difference buffers in the linked list and in the
+ *	per-CPU pools.
+ * @free_diff_buffers_pcp:
+ *	Per-CPU pools of free difference buffers. They allow to take and
+ *	release buffers without contention on the free_diff_buffers_lock.
+ * @shrinker:
+ *	Allows to release the clean chunks of the read cache and the free
+ *	difference buffers when the system runs short of memory.
+ * @shrinker_registered:
+ *	The shrinker has been registered and should be unregistered when
+ *	releasing the diff area.
  * @corrupt_flag:
  *	The flag is set if an error occurred in the operation of the data
  *	saving mechanism in the diff area. In this case, an error will be
@@ -63,6 +93,19 @@ struct chunk;
  * @pending_io_count:
  *	Counter of incomplete I/O operations. Allows to wait for all I/O
  *	operations to be completed before releasing this structure.
+ * @image_io_count:
+ *	Counter of incomplete I/O operations that were initiated by the
+ *	snapshot image. The rest of the incomplete I/O operations are the
+ *	copy-on-write operations of the original block device.
+ * @io_wait:
+ *	The snapshot image waits here for the completion of the I/O
+ *	operations when they exceed its share.
+ * @stored_sectors:
+ *	The number of sectors of the difference storage regions allocated for
+ *	the chunks of this block device.
+ * @region_count:
+ *	The number of the difference storage regions allocated for the chunks
+ *	of this block device.
  *
  * The &struct diff_area is created for each block device in the snapshot.
  * It is used to save the differences between the original block device and
@@ -93,10 +136,16 @@ struct chunk;
  * "hot" buffers. This allows to reduce the number of allocations and releases
  * of memory.
  *
+ * The limits of the read cache and of the pool of free buffers are soft.
+ * While the system has plenty of available memory, they are allowed to grow
+ * beyond their limits. When memory becomes scarce, the shrinker releases
+ * the clean chunks from the read cache and the free buffers from the pool.
+ *
  *
  */
 struct diff_area {
 	struct kref kref;
+	struct list_head tracker_link;
 
 	struct block_device *orig_bdev;
 	struct diff_storage *diff_storage;
@@ -113,15 +162,30 @@ struct diff_area {
 	struct list_head write_cache_queue;
 	atomic_t write_cache_count;
 	struct work_struct cache_release_work;
+	struct list_head prefetch_queue;
+	struct work_struct prefetch_work;
+	struct workqueue_struct *cache_release_wq;
 
 	spinlock_t free_diff_buffers_lock;
 	struct list_head free_diff_buffers;
 	atomic_t free_diff_buffers_count;
+	struct diff_buffer_pcp __percpu *free_diff_buffers_pcp;
+
+	struct shrinker shrinker;
+	bool shrinker_registered;
 
 	atomic_t corrupt_flag;
 	atomic_t pending_io_count;
+	atomic_t image_io_count;
+	wait_queue_head_t io_wait;
+
+	atomic64_t stored_sectors;
+	atomic64_t region_count;
 };
 
+int diff_area_init(void);
+void diff_area_done(void);
+
 struct diff_area *diff_area_new(dev_t dev_id,
 				struct diff_storage *diff_storage);
 void diff_area_free(struct kref *kref);
@@ -143,8 +207,18 @@ static inline sector_t diff_area_chunk_sectors(struct diff_area *diff_area)
 {
 	return (sector_t)(1ull << (diff_area->chunk_shift - SECTOR_SHIFT));
 };
-int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
-		   const bool is_nowait);
+static inline void diff_area_io_start(struct diff_area *diff_area,
+				      const bool is_image)
+{
+	atomic_inc(&diff_area->pending_io_count);
+	if (is_image)
+		atomic_inc(&diff_area->image_io_count);
+};
+void diff_area_io_end(struct diff_area *diff_area, const bool is_image);
+int diff_area_write_cache_high(void);
+int diff_area_write_cache_low(void);
+int diff_area_copy(struct diff_area *diff_area, struct diff_area *leader,
+		   sector_t sector, sector_t count, const bool is_nowait);
 
 int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
                    const bool is_nowait);
@@ -158,11 +232,23 @@ int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
  *	processing a request.
  * @chunk:
  *	Current chunk.
+ * @is_chunk_shared:
+ *	The current chunk is locked for reading and remains in the cache.
+ * @write_end:
+ *	The sector following the last sector of the write request. Allows to
+ *	detect that the request overwrites the chunk completely.
+ * @is_chunk_unloaded:
+ *	The buffer of the current chunk was not loaded, since the write
+ *	request overwrites the chunk completely. If writing fails, the buffer
+ *	is discarded.
  */
 struct diff_area_image_ctx {
 	struct diff_area *diff_area;
 	bool is_write;
 	struct chunk *chunk;
+	bool is_chunk_shared;
+	sector_t write_end;
+	bool is_chunk_unloaded;
 };
 
 static inline void diff_area_image_ctx_init(struct diff_area_image_ctx *io_ctx,
@@ -172,13 +258,25 @@ static inline void diff_area_image_ctx_init(struct diff_area_image_ctx *io_ctx,
 	io_ctx->diff_area = diff_area;
 	io_ctx->is_write = is_write;
 	io_ctx->chunk = NULL;
+	io_ctx->is_chunk_shared = false;
+	io_ctx->write_end = 0;
+	io_ctx->is_chunk_unloaded = false;
 };
 void diff_area_image_ctx_done(struct diff_area_image_ctx *io_ctx);
 blk_status_t diff_area_image_io(struct diff_area_image_ctx *io_ctx,
 				const struct bio_vec *bvec, sector_t *pos);
+blk_status_t diff_area_image_read(struct diff_area_image_ctx *io_ctx,
+				  struct bio *bio);
+void diff_area_prefetch_chunk(struct diff_area *diff_area,
+			      unsigned long number);
 
 /**
+ * diff_area_throttling_io() - Waits until the snapshot image is allowed to
+ *	start a new I/O operation.
  *
+ * The copy-on-write operations of the original block device have priority.
+ * The snapshot image is allowed a share of the incomplete I/O operations
+ * defined by the cow_io_weight and image_io_weight module parameters.
  */
 void diff_area_throttling_io(struct diff_area *diff_area);
 
@@ -1,5 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0
 #define pr_fmt(fmt) KBUILD_MODNAME "-diff-buffer: " fmt
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/xxhash.h>
 #include "memory_checker.h"
 #include "params.h"
 #include "diff_buffer.h"
@@ -24,20 +27,35 @@ static int diff_buffer_take_cnt_get(void)
 
 #endif
 
+/*
+ * The maximum order of pages for the difference buffer. Larger allocations
+ * are hard to satisfy when memory is fragmented, but the attempt is cheap
+ * thanks to __GFP_NORETRY.
+ */
+#define DIFF_BUFFER_MAX_ORDER min_t(unsigned int, 8, MAX_ORDER - 1)
+
+/*
+ * The number of free buffers that can be held in the pool of each CPU.
+ * The rest of the free buffers are stored in the shared pool of the diff
+ * area.
+ */
+#define DIFF_BUFFER_PCP_MAX 4
+
 static void diff_buffer_free(struct diff_buffer *diff_buffer)
 {
 	size_t inx = 0;
-	struct page *page;
+	size_t page_inx;
+	struct diff_buffer_segment *segment;
 
 	if (unlikely(!diff_buffer))
 		return;
 
-	for (inx = 0; inx < diff_buffer->page_count; inx++) {
-		page = diff_buffer->pages[inx];
-		if (page) {
-			__free_page(page);
+	for (inx = 0; inx < diff_buffer->segment_count; inx++) {
+		segment = &diff_buffer->segments[inx];
+
+		__free_pages(segment->page, segment->order);
+		for (page_inx = 0; page_inx < (1 << segment->order); page_inx++)
 			memory_object_dec(memory_object_page);
-		}
 	}
 
 	kfree(diff_buffer);
@@ -52,7 +70,9 @@ diff_buffer_new(size_t page_count, size_t buffer_size, gfp_t gfp_mask)
 {
 	struct diff_buffer *diff_buffer;
 	size_t inx = 0;
+	size_t page_inx;
 	struct page *page;
+	unsigned int order = DIFF_BUFFER_MAX_ORDER;
 
 	if (unlikely(page_count <= 0))
 		return NULL;
@@ -60,9 +80,12 @@ diff_buffer_new(size_t page_count, size_t buffer_size, gfp_t gfp_mask)
 	/*
 	 * In case of overflow, it is better to get a null pointer
 	 * than a pointer to some memory area. Therefore + 1.
+	 * The segments array takes no more elements than the pages array.
 	 */
 	diff_buffer = kzalloc(sizeof(struct diff_buffer) +
-				      (page_count + 1) * sizeof(struct page *),
+				      (page_count + 1) * sizeof(struct page *) +
+				      page_count *
+					      sizeof(struct diff_buffer_segment),
 			      gfp_mask);
 	if (!diff_buffer)
 		return NULL;
@@ -74,14 +97,38 @@ diff_buffer_new(size_t page_count, size_t buffer_size, gfp_t gfp_mask)
 	INIT_LIST_HEAD(&diff_buffer->link);
 	diff_buffer->size = buffer_size;
 	diff_buffer->page_count = page_count;
+	diff_buffer->segments =
+		(struct diff_buffer_segment *)&diff_buffer->pages[page_count + 1];
 
-	for (inx = 0; inx < page_count; inx++) {
-		page = alloc_page(gfp_mask);
+	while (inx < page_count) {
+		/*
+		 * The order of the segment cannot exceed the number of the
+		 * remaining pages. If it was not possible to allocate a segment
+		 * of some order, then larger ones should not be tried again.
+		 */
+		order = min_t(unsigned int, order, ilog2(page_count - inx));
+		while (true) {
+			if (order)
+				page = alloc_pages(gfp_mask | __GFP_NORETRY |
+							   __GFP_NOWARN,
+						   order);
+			else
+				page = alloc_page(gfp_mask);
+			if (page || !order)
+				break;
+			order--;
+		}
 		if (!page)
 			goto fail;
-		memory_object_inc(memory_object_page);
 
-		diff_buffer->pages[inx] = page;
+		diff_buffer->segments[diff_buffer->segment_count].page = page;
+		diff_buffer->segments[diff_buffer->segment_count].order = order;
+		diff_buffer->segment_count++;
+
+		for (page_inx = 0; page_inx < (1 << order); page_inx++) {
+			memory_object_inc(memory_object_page);
+			diff_buffer->pages[inx++] = page + page_inx;
+		}
 	}
 	return diff_buffer;
 fail:
@@ -89,6 +136,52 @@ fail:
 	return NULL;
 }
 
+static inline struct diff_buffer *
+diff_buffer_pool_get(spinlock_t *lock, struct list_head *free_diff_buffers,
+		     int *count)
+{
+	struct diff_buffer *diff_buffer;
+	unsigned long flags;
+
+	spin_lock_irqsave(lock, flags);
+	diff_buffer = list_first_entry_or_null(free_diff_buffers,
+					       struct diff_buffer, link);
+	if (diff_buffer) {
+		list_del(&diff_buffer->link);
+		if (count)
+			(*count)--;
+	}
+	spin_unlock_irqrestore(lock, flags);
+
+	return diff_buffer;
+}
+
+/*
+ * At first, the buffer is taken from the pool of the current CPU. The
+ * process can be migrated to another CPU, but this is not a problem,
+ * since the pool is protected by its own lock.
+ */
+static struct diff_buffer *diff_buffer_pool_take(struct diff_area *diff_area)
+{
+	struct diff_buffer *diff_buffer = NULL;
+	struct diff_buffer_pcp *pcp;
+
+	if (likely(diff_area->free_diff_buffers_pcp)) {
+		pcp = per_cpu_ptr(diff_area->free_diff_buffers_pcp,
+				  raw_smp_processor_id());
+		diff_buffer = diff_buffer_pool_get(
+			&pcp->lock, &pcp->free_diff_buffers, &pcp->count);
+	}
+	if (!diff_buffer)
+		diff_buffer = diff_buffer_pool_get(
+			&diff_area->free_diff_buffers_lock,
+			&diff_area->free_diff_buffers, NULL);
+	if (diff_buffer)
+		atomic_dec(&diff_area->free_diff_buffers_count);
+
+	return diff_buffer;
+}
+
 struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 				     const bool is_nowait)
 {
@@ -97,16 +190,8 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 	size_t page_count;
 	size_t buffer_size;
 
-	spin_lock(&diff_area->free_diff_buffers_lock);
-	diff_buffer = list_first_entry_or_null(&diff_area->free_diff_buffers,
-					       struct diff_buffer, link);
-	if (diff_buffer) {
-		list_del(&diff_buffer->link);
-		atomic_dec(&diff_area->free_diff_buffers_count);
-	}
-	spin_unlock(&diff_area->free_diff_buffers_lock);
-
 	/* Return free buffer if it was found in a pool */
+	diff_buffer = diff_buffer_pool_take(diff_area);
 	if (diff_buffer) {
 #ifdef BLK_SNAP_DEBUG_DIFF_BUFFER
 		atomic_inc(&diff_buffer_take_cnt);
@@ -135,44 +220,261 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 	return diff_buffer;
 }
 
+/**
+ * diff_buffer_memory_plentiful() - Checks that the system has enough
+ *	available memory to keep more buffers than the limits allow.
+ *
+ * The chunk cache and the pool of free buffers can grow opportunistically
+ * while this function returns true. When memory runs short, the excess
+ * buffers are released by the diff area shrinker.
+ */
+bool diff_buffer_memory_plentiful(void)
+{
+	unsigned long reserve;
+
+	if (cache_min_available_percent >= 100)
+		return false;
+
+	reserve = totalram_pages() / 100 * cache_min_available_percent;
+	return si_mem_available() > (long)reserve;
+}
+
 void diff_buffer_release(struct diff_area *diff_area,
 			 struct diff_buffer *diff_buffer)
 {
+	struct diff_buffer_pcp *pcp;
+	unsigned long flags;
+
 #ifdef BLK_SNAP_DEBUG_DIFF_BUFFER
 	atomic_dec(&diff_buffer_take_cnt);
 #endif
-	if (atomic_read(&diff_area->free_diff_buffers_count) >
-	    free_diff_buffer_pool_size) {
+	if ((atomic_read(&diff_area->free_diff_buffers_count) >
+	     free_diff_buffer_pool_size) &&
+	    !diff_buffer_memory_plentiful()) {
 		diff_buffer_free(diff_buffer);
 		return;
 	}
-	spin_lock(&diff_area->free_diff_buffers_lock);
-	list_add_tail(&diff_buffer->link, &diff_area->free_diff_buffers);
 	atomic_inc(&diff_area->free_diff_buffers_count);
-	spin_unlock(&diff_area->free_diff_buffers_lock);
+
+	if (likely(diff_area->free_diff_buffers_pcp)) {
+		pcp = per_cpu_ptr(diff_area->free_diff_buffers_pcp,
+				  raw_smp_processor_id());
+		spin_lock_irqsave(&pcp->lock, flags);
+		if (pcp->count < DIFF_BUFFER_PCP_MAX) {
+			list_add(&diff_buffer->link, &pcp->free_diff_buffers);
+			pcp->count++;
+			diff_buffer = NULL;
+		}
+		spin_unlock_irqrestore(&pcp->lock, flags);
+		if (!diff_buffer)
+			return;
+	}
+
+	spin_lock_irqsave(&diff_area->free_diff_buffers_lock, flags);
+	list_add_tail(&diff_buffer->link, &diff_area->free_diff_buffers);
+	spin_unlock_irqrestore(&diff_area->free_diff_buffers_lock, flags);
 }
 
-void diff_buffer_cleanup(struct diff_area *diff_area)
+/**
+ * diff_buffer_pool_shrink() - Releases one buffer from the pool of free
+ *	buffers.
+ *
+ * The shared pool is released first, since the per-CPU pools keep the most
+ * recently used buffers.
+ * Returns the number of released pages, or zero if the pool is empty.
+ */
+unsigned long diff_buffer_pool_shrink(struct diff_area *diff_area)
 {
-	struct diff_buffer *diff_buffer = NULL;
+	struct diff_buffer *diff_buffer;
+	unsigned long page_count;
+	int cpu;
+
+	diff_buffer = diff_buffer_pool_get(&diff_area->free_diff_buffers_lock,
+					   &diff_area->free_diff_buffers, NULL);
+	if (!diff_buffer && diff_area->free_diff_buffers_pcp) {
+		for_each_possible_cpu(cpu) {
+			struct diff_buffer_pcp *pcp = per_cpu_ptr(
+				diff_area->free_diff_buffers_pcp, cpu);
+
+			diff_buffer = diff_buffer_pool_get(
+				&pcp->lock, &pcp->free_diff_buffers,
+				&pcp->count);
+			if (diff_buffer)
+				break;
+		}
+	}
+	if (!diff_buffer)
+		return 0;
+	atomic_dec(&diff_area->free_diff_buffers_count);
+
+	page_count = diff_buffer->page_count;
+	diff_buffer_free(diff_buffer);
+	return page_count;
+}
 
+/*
+ * Both buffers should be of the same size, which is true for the chunks with
+ * the same number in the difference areas with the same chunk size.
+ */
+void diff_buffer_copy(struct diff_buffer *dst, struct diff_buffer *src)
+{
+	size_t inx;
+
+	WARN_ON(dst->page_count != src->page_count);
+	for (inx = 0; inx < min(dst->page_count, src->page_count); inx++)
+		copy_highpage(dst->pages[inx], src->pages[inx]);
+}
+
+/*
+ * Copies the data between the buffer and a virtually contiguous memory.
+ * The pages of the buffer are not allocated from the high memory, so each
+ * segment is copied at once.
+ */
+void diff_buffer_read(struct diff_buffer *diff_buffer, void *dst, size_t size)
+{
+	size_t inx;
+	size_t offset = 0;
+
+	for (inx = 0; (inx < diff_buffer->segment_count) && (offset < size);
+	     inx++) {
+		struct diff_buffer_segment *segment = &diff_buffer->segments[inx];
+		size_t bytes = min_t(size_t, PAGE_SIZE << segment->order,
+				     size - offset);
+
+		memcpy(dst + offset, page_address(segment->page), bytes);
+		offset += bytes;
+	}
+}
+
+void diff_buffer_write(struct diff_buffer *diff_buffer, const void *src,
+		       size_t size)
+{
+	size_t inx;
+	size_t offset = 0;
+
+	for (inx = 0; (inx < diff_buffer->segment_count) && (offset < size);
+	     inx++) {
+		struct diff_buffer_segment *segment = &diff_buffer->segments[inx];
+		size_t bytes = min_t(size_t, PAGE_SIZE << segment->order,
+				     size - offset);
+
+		memcpy(page_address(segment->page), src + offset, bytes);
+		offset += bytes;
+	}
+}
+
+/*
+ * Checks that the first size bytes of the buffer are zeros. The memchr_inv()
+ * compares the memory with machine words, so the check is much faster than
+ * writing or reading the data.
+ */
+bool diff_buffer_is_zero(struct diff_buffer *diff_buffer, size_t size)
+{
+	size_t inx;
+	size_t offset = 0;
+
+	for (inx = 0; (inx < diff_buffer->segment_count) && (offset < size);
+	     inx++) {
+		struct diff_buffer_segment *segment = &diff_buffer->segments[inx];
+		size_t bytes = min_t(size_t, PAGE_SIZE << segment->order,
+				     size - offset);
+
+		if (memchr_inv(page_address(segment->page), 0, bytes))
+			return false;
+		offset += bytes;
+	}
+
+	return true;
+}
+
+bool diff_buffer_equal(struct diff_buffer *first, struct diff_buffer *second,
+		       size_t size)
+{
+	size_t offset;
+
+	for (offset = 0; offset < size; offset += PAGE_SIZE) {
+		size_t inx = offset >> PAGE_SHIFT;
+
+		if ((inx >= first->page_count) || (inx >= second->page_count))
+			return false;
+
+		if (memcmp(page_address(first->pages[inx]),
+			   page_address(second->pages[inx]),
+			   min_t(size_t, PAGE_SIZE, size - offset)))
+			return false;
+	}
+
+	return true;
+}
+
+u64 diff_buffer_hash(struct diff_buffer *diff_buffer, size_t size)
+{
+	size_t inx;
+	size_t offset = 0;
+	struct xxh64_state state;
+
+	xxh64_reset(&state, 0);
+	for (inx = 0; (inx < diff_buffer->segment_count) && (offset < size);
+	     inx++) {
+		struct diff_buffer_segment *segment = &diff_buffer->segments[inx];
+		size_t bytes = min_t(size_t, PAGE_SIZE << segment->order,
+				     size - offset);
+
+		xxh64_update(&state, page_address(segment->page), bytes);
+		offset += bytes;
+	}
+
+	return xxh64_digest(&state);
+}
+
+void diff_buffer_clear(struct diff_buffer *diff_buffer)
+{
+	size_t inx;
+
+	for (inx = 0; inx < diff_buffer->segment_count; inx++) {
+		struct diff_buffer_segment *segment = &diff_buffer->segments[inx];
+
+		memset(page_address(segment->page), 0,
+		       PAGE_SIZE << segment->order);
+	}
+}
+
+int diff_buffer_pool_init(struct diff_area *diff_area)
+{
+	int cpu;
+
+	spin_lock_init(&diff_area->free_diff_buffers_lock);
+	INIT_LIST_HEAD(&diff_area->free_diff_buffers);
+	atomic_set(&diff_area->free_diff_buffers_count, 0);
+
+	diff_area->free_diff_buffers_pcp = alloc_percpu(struct diff_buffer_pcp);
+	if (!diff_area->free_diff_buffers_pcp)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct diff_buffer_pcp *pcp =
+			per_cpu_ptr(diff_area->free_diff_buffers_pcp, cpu);
+
+		spin_lock_init(&pcp->lock);
+		INIT_LIST_HEAD(&pcp->free_diff_buffers);
+		pcp->count = 0;
+	}
+
+	return 0;
+}
+
+void diff_buffer_cleanup(struct diff_area *diff_area)
+{
 #ifdef BLK_SNAP_DEBUG_DIFF_BUFFER
 	pr_debug("Cleanup %d buffers\n", diff_buffer_allocated_counter_get());
 #endif
-	do {
-		spin_lock(&diff_area->free_diff_buffers_lock);
-		diff_buffer =
-			list_first_entry_or_null(&diff_area->free_diff_buffers,
-						 struct diff_buffer, link);
-		if (diff_buffer) {
-			list_del(&diff_buffer->link);
-			atomic_dec(&diff_area->free_diff_buffers_count);
-		}
-		spin_unlock(&diff_area->free_diff_buffers_lock);
+	while (diff_buffer_pool_shrink(diff_area))
+		;
 
-		if (diff_buffer)
-			diff_buffer_free(diff_buffer);
-	} while (diff_buffer);
+	if (diff_area->free_diff_buffers_pcp) {
+		free_percpu(diff_area->free_diff_buffers_pcp);
+		diff_area->free_diff_buffers_pcp = NULL;
+	}
 #ifdef BLK_SNAP_DEBUG_DIFF_BUFFER
 	if (diff_buffer_allocated_counter_get())
 		pr_debug("Some buffers %d still available\n",
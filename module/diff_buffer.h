@@ -9,6 +9,18 @@
 
 struct diff_area;
 
+/**
+ * struct diff_buffer_segment - A physically contiguous part of the buffer.
+ * @page:
+ *	The first page of the segment.
+ * @order:
+ *	The allocation order of the segment.
+ */
+struct diff_buffer_segment {
+	struct page *page;
+	unsigned int order;
+};
+
 /**
  * struct diff_buffer - Difference buffer.
  * @link:
@@ -17,10 +29,19 @@ struct diff_area;
  *	Count of bytes in the buffer.
  * @page_count:
  *	The number of pages reserved for the buffer.
+ * @segment_count:
+ *	The number of physically contiguous segments in the buffer.
+ * @segments:
+ *	An array of segments. It is located in the same memory allocation
+ *	right after the array of pointers to pages.
  * @pages:
  *	An array of pointers to pages.
  *
  * Describes the memory buffer for a chunk in the memory.
+ * The buffer is allocated with high-order pages whenever possible, so it
+ * consists of a few large segments. This reduces the number of allocations
+ * and allows to build a bio with a few multi-page bvecs. The array of
+ * pointers to pages allows to quickly find a page at any offset.
  */
 struct diff_buffer {
 	struct list_head link;
@@ -29,9 +50,27 @@ struct diff_buffer {
 	int number;
 #endif
 	size_t page_count;
+	size_t segment_count;
+	struct diff_buffer_segment *segments;
 	struct page *pages[0];
 };
 
+/**
+ * struct diff_buffer_pcp - Per-CPU pool of free difference buffers.
+ * @lock:
+ *	Protects the list. The pool can be used from another CPU if the
+ *	process has been migrated, so the lock cannot be omitted.
+ * @free_diff_buffers:
+ *	Linked list of free difference buffers.
+ * @count:
+ *	The number of buffers in the list.
+ */
+struct diff_buffer_pcp {
+	spinlock_t lock;
+	struct list_head free_diff_buffers;
+	int count;
+};
+
 /**
  * struct diff_buffer_iter - Iterator for &struct diff_buffer.
  * @page:
@@ -78,5 +117,17 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 				     const bool is_nowait);
 void diff_buffer_release(struct diff_area *diff_area,
 			 struct diff_buffer *diff_buffer);
+void diff_buffer_copy(struct diff_buffer *dst, struct diff_buffer *src);
+void diff_buffer_read(struct diff_buffer *diff_buffer, void *dst, size_t size);
+void diff_buffer_write(struct diff_buffer *diff_buffer, const void *src,
+		       size_t size);
+bool diff_buffer_is_zero(struct diff_buffer *diff_buffer, size_t size);
+bool diff_buffer_equal(struct diff_buffer *first, struct diff_buffer *second,
+		       size_t size);
+u64 diff_buffer_hash(struct diff_buffer *diff_buffer, size_t size);
+void diff_buffer_clear(struct diff_buffer *diff_buffer);
+int diff_buffer_pool_init(struct diff_area *diff_area);
 void diff_buffer_cleanup(struct diff_area *diff_area);
+unsigned long diff_buffer_pool_shrink(struct diff_area *diff_area);
+bool diff_buffer_memory_plentiful(void);
 #endif /* __BLK_SNAP_DIFF_BUFFER_H */
@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: GPL-2.0
+#define pr_fmt(fmt) KBUILD_MODNAME "-diff-compress: " fmt
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched/mm.h>
+#include <linux/crypto.h>
+#include "memory_checker.h"
+#include "params.h"
+#include "diff_buffer.h"
+#include "diff_compress.h"
+#ifdef STANDALONE_BDEVFILTER
+#include "log.h"
+#endif
+
+#define DIFF_COMPRESS_ALGORITHM "lz4"
+
+/**
+ * struct diff_compress_header - The header of the compressed chunk in the
+ *	difference storage.
+ * @size:
+ *	The size of the compressed data that follows the header.
+ *
+ * The region of the compressed chunk is aligned to the page size, so the
+ * algorithm needs the exact size of the data.
+ */
+struct diff_compress_header {
+	__le32 size;
+};
+
+static struct diff_compressor __percpu *diff_compressors;
+
+bool diff_compress_enabled(void)
+{
+	return !!diff_compressors;
+}
+
+static void diff_compressor_free_buffers(struct diff_compressor *compressor)
+{
+	if (compressor->src) {
+		kvfree(compressor->src);
+		memory_object_dec(memory_object_compress_buffer);
+	}
+	if (compressor->dst) {
+		kvfree(compressor->dst);
+		memory_object_dec(memory_object_compress_buffer);
+	}
+	compressor->src = NULL;
+	compressor->dst = NULL;
+	compressor->size = 0;
+}
+
+/*
+ * Should be called while holding the lock of the compressor. The buffers
+ * are allocated in the I/O processing context, so the allocation must not
+ * start the I/O.
+ */
+static int diff_compressor_reserve(struct diff_compressor *compressor,
+				   size_t size)
+{
+	unsigned int current_flag;
+
+	if (likely(compressor->size >= size))
+		return 0;
+
+	diff_compressor_free_buffers(compressor);
+
+	current_flag = memalloc_noio_save();
+	compressor->src = kvmalloc(size, GFP_KERNEL);
+	if (compressor->src)
+		memory_object_inc(memory_object_compress_buffer);
+	compressor->dst = kvmalloc(size, GFP_KERNEL);
+	if (compressor->dst)
+		memory_object_inc(memory_object_compress_buffer);
+	memalloc_noio_restore(current_flag);
+
+	if (!compressor->src || !compressor->dst) {
+		diff_compressor_free_buffers(compressor);
+		return -ENOMEM;
+	}
+
+	compressor->size = size;
+	return 0;
+}
+
+/**
+ * diff_compress() - Compresses the data of the buffer in place.
+ * @diff_buffer:
+ *	The buffer of the chunk.
+ * @size:
+ *	The size of the data in bytes.
+ * @compressed_size:
+ *	The size of the compressed data including the header.
+ *
+ * Returns -E2BIG if the compression does not save at least one page. In
+ * this case, the buffer is not changed.
+ */
+int diff_compress(struct diff_buffer *diff_buffer, size_t size,
+		  size_t *compressed_size)
+{
+	int ret;
+	struct diff_compressor *compressor;
+	struct diff_compress_header *header;
+	unsigned int dlen;
+
+	if (size <= (PAGE_SIZE + sizeof(struct diff_compress_header)))
+		return -E2BIG;
+
+	compressor = raw_cpu_ptr(diff_compressors);
+	mutex_lock(&compressor->lock);
+
+	ret = diff_compressor_reserve(compressor, size);
+	if (unlikely(ret))
+		goto out;
+
+	diff_buffer_read(diff_buffer, compressor->src, size);
+
+	dlen = size - PAGE_SIZE - sizeof(struct diff_compress_header);
+	header = compressor->dst;
+	ret = crypto_comp_compress(compressor->tfm, compressor->src, size,
+				   compressor->dst + sizeof(*header), &dlen);
+	if (ret) {
+		/* The data does not fit into the smaller region. */
+		ret = -E2BIG;
+		goto out;
+	}
+
+	header->size = cpu_to_le32(dlen);
+	*compressed_size = sizeof(*header) + dlen;
+	diff_buffer_write(diff_buffer, compressor->dst, *compressed_size);
+out:
+	mutex_unlock(&compressor->lock);
+	return ret;
+}
+
+/**
+ * diff_decompress() - Decompresses the data of the buffer in place.
+ * @diff_buffer:
+ *	The buffer with the compressed chunk loaded from the difference
+ *	storage.
+ * @size:
+ *	The size of the chunk in bytes.
+ */
+int diff_decompress(struct diff_buffer *diff_buffer, size_t size)
+{
+	int ret;
+	struct diff_compressor *compressor;
+	struct diff_compress_header *header;
+	unsigned int slen;
+	unsigned int dlen = size;
+
+	compressor = raw_cpu_ptr(diff_compressors);
+	mutex_lock(&compressor->lock);
+
+	ret = diff_compressor_reserve(compressor, size);
+	if (unlikely(ret))
+		goto out;
+
+	header = page_address(diff_buffer->pages[0]);
+	slen = le32_to_cpu(header->size);
+	if (unlikely(slen > (size - sizeof(*header)))) {
+		pr_err("Invalid size of the compressed chunk %u\n", slen);
+		ret = -EIO;
+		goto out;
+	}
+
+	diff_buffer_read(diff_buffer, compressor->src, sizeof(*header) + slen);
+	ret = crypto_comp_decompress(compressor->tfm,
+				     compressor->src + sizeof(*header), slen,
+				     compressor->dst, &dlen);
+	if (unlikely(ret || (dlen != size))) {
+		pr_err("Failed to decompress the chunk. errno=%d\n", abs(ret));
+		ret = -EIO;
+		goto out;
+	}
+
+	diff_buffer_write(diff_buffer, compressor->dst, size);
+out:
+	mutex_unlock(&compressor->lock);
+	return ret;
+}
+
+int diff_compress_init(void)
+{
+	int cpu;
+	struct diff_compressor __percpu *compressors;
+
+	if (!chunk_compression)
+		return 0;
+
+	compressors = alloc_percpu(struct diff_compressor);
+	if (!compressors)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct diff_compressor *compressor =
+			per_cpu_ptr(compressors, cpu);
+		struct crypto_comp *tfm;
+
+		mutex_init(&compressor->lock);
+		tfm = crypto_alloc_comp(DIFF_COMPRESS_ALGORITHM, 0, 0);
+		if (IS_ERR(tfm)) {
+			/*
+			 * The module can work without the compression, so
+			 * the failure is not fatal.
+			 */
+			pr_err("Failed to allocate %s compression. errno=%d\n",
+			       DIFF_COMPRESS_ALGORITHM, abs((int)PTR_ERR(tfm)));
+			diff_compressors = compressors;
+			diff_compress_done();
+			return 0;
+		}
+		compressor->tfm = tfm;
+	}
+
+	diff_compressors = compressors;
+	pr_info("Chunks are compressed with %s\n", DIFF_COMPRESS_ALGORITHM);
+	return 0;
+}
+
+void diff_compress_done(void)
+{
+	int cpu;
+
+	if (!diff_compressors)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct diff_compressor *compressor =
+			per_cpu_ptr(diff_compressors, cpu);
+
+		if (compressor->tfm)
+			crypto_free_comp(compressor->tfm);
+		diff_compressor_free_buffers(compressor);
+	}
+
+	free_percpu(diff_compressors);
+	diff_compressors = NULL;
+}
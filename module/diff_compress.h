@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __BLK_SNAP_DIFF_COMPRESS_H
+#define __BLK_SNAP_DIFF_COMPRESS_H
+
+#include <linux/types.h>
+#include <linux/mutex.h>
+
+struct diff_buffer;
+struct crypto_comp;
+
+/**
+ * struct diff_compressor - Per-CPU context of the compression.
+ * @lock:
+ *	The mutex protects the context. The process can be migrated to
+ *	another CPU while the data is being compressed.
+ * @tfm:
+ *	The compression transform.
+ * @src:
+ *	A virtually contiguous copy of the data of the buffer.
+ * @dst:
+ *	The result of the compression or decompression.
+ * @size:
+ *	The size of both buffers in bytes.
+ *
+ * The algorithm cannot process the buffers of the chunks directly, since
+ * they consist of several segments. The data is copied to the virtually
+ * contiguous buffers that are allocated on the first use and grow up to the
+ * size of the largest chunk.
+ */
+struct diff_compressor {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	void *src;
+	void *dst;
+	size_t size;
+};
+
+int diff_compress_init(void);
+void diff_compress_done(void);
+
+bool diff_compress_enabled(void);
+int diff_compress(struct diff_buffer *diff_buffer, size_t size,
+		  size_t *compressed_size);
+int diff_decompress(struct diff_buffer *diff_buffer, size_t size);
+#endif /* __BLK_SNAP_DIFF_COMPRESS_H */
@@ -5,6 +5,7 @@
 #endif
 #include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include "memory_checker.h"
 #include "diff_io.h"
 #include "diff_buffer.h"
@@ -15,19 +16,89 @@
 #endif
 #endif
 
+/*
+ * The number of diff_io structures reserved in the mempool. It corresponds
+ * to the number of bios reserved in the bioset, which allows to make
+ * progress in processing I/O even when the memory is exhausted.
+ */
+#define DIFF_IO_POOL_SIZE 64
+
 struct bio_set diff_io_bioset;
+static struct kmem_cache *diff_io_cache;
+static mempool_t *diff_io_pool;
+/*
+ * The completion of the I/O is processed on the same CPU on which the bio
+ * completion handler was called. A high-priority queue reduces the latency
+ * of the copy-on-write operation, which blocks writing to the original
+ * block device.
+ */
+static struct workqueue_struct *diff_io_wq;
 
 int diff_io_init(void)
 {
-	return bioset_init(&diff_io_bioset, 64, 0,
-			   BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
+	int ret;
+
+	ret = bioset_init(&diff_io_bioset, DIFF_IO_POOL_SIZE, 0,
+			  BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
+	if (ret)
+		return ret;
+
+	diff_io_cache = kmem_cache_create("blksnap_diff_io",
+					  sizeof(struct diff_io), 0, 0, NULL);
+	if (!diff_io_cache) {
+		ret = -ENOMEM;
+		goto fail_bioset_exit;
+	}
+
+	diff_io_pool = mempool_create_slab_pool(DIFF_IO_POOL_SIZE,
+						diff_io_cache);
+	if (!diff_io_pool) {
+		ret = -ENOMEM;
+		goto fail_cache_destroy;
+	}
+
+	diff_io_wq = alloc_workqueue("blksnap-diff-io",
+				     WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if (!diff_io_wq) {
+		ret = -ENOMEM;
+		goto fail_pool_destroy;
+	}
+
+	return 0;
+
+fail_pool_destroy:
+	mempool_destroy(diff_io_pool);
+	diff_io_pool = NULL;
+fail_cache_destroy:
+	kmem_cache_destroy(diff_io_cache);
+	diff_io_cache = NULL;
+fail_bioset_exit:
+	bioset_exit(&diff_io_bioset);
+	return ret;
 }
 
 void diff_io_done(void)
 {
+	if (diff_io_wq) {
+		destroy_workqueue(diff_io_wq);
+		diff_io_wq = NULL;
+	}
+	mempool_destroy(diff_io_pool);
+	diff_io_pool = NULL;
+	kmem_cache_destroy(diff_io_cache);
+	diff_io_cache = NULL;
 	bioset_exit(&diff_io_bioset);
 }
 
+void diff_io_free(struct diff_io *diff_io)
+{
+	if (unlikely(!diff_io))
+		return;
+
+	mempool_free(diff_io, diff_io_pool);
+	memory_object_dec(memory_object_diff_io);
+}
+
 static void diff_io_notify_cb(struct work_struct *work)
 {
 	struct diff_io_async *async =
@@ -37,6 +108,16 @@ static void diff_io_notify_cb(struct work_struct *work)
 	async->notify_cb(async->ctx);
 }
 
+static inline void diff_io_notify(struct diff_io *diff_io)
+{
+	if (diff_io->is_sync_io)
+		complete(&diff_io->notify.sync.completion);
+	else if (diff_io->notify.async.is_atomic && !diff_io->error)
+		diff_io->notify.async.notify_cb(diff_io->notify.async.ctx);
+	else
+		queue_work(diff_io_wq, &diff_io->notify.async.work);
+}
+
 #ifdef STANDALONE_BDEVFILTER
 void diff_io_endio(struct bio *bio)
 #else
@@ -49,20 +130,12 @@ static void diff_io_endio(struct bio *bio)
 		diff_io->error = -EIO;
 
 #ifdef HAVE_BIO_MAX_PAGES
-	if (atomic_dec_and_test(&diff_io->bio_count)) {
-		if (diff_io->is_sync_io)
-			complete(&diff_io->notify.sync.completion);
-		else
-			queue_work(system_wq, &diff_io->notify.async.work);
-	}
+	if (atomic_dec_and_test(&diff_io->bio_count))
+		diff_io_notify(diff_io);
 #else
-	if (diff_io->is_sync_io)
-		complete(&diff_io->notify.sync.completion);
-	else
-		queue_work(system_wq, &diff_io->notify.async.work);
+	diff_io_notify(diff_io);
 #endif
 
-
 	bio_put(bio);
 }
 
@@ -71,11 +144,16 @@ static inline struct diff_io *diff_io_new(bool is_write, bool is_nowait)
 	struct diff_io *diff_io;
 	gfp_t gfp_mask = is_nowait ? (GFP_NOIO | GFP_NOWAIT) : GFP_NOIO;
 
-	diff_io = kzalloc(sizeof(struct diff_io), gfp_mask);
+	/*
+	 * If waiting is allowed, then the allocation from the mempool cannot
+	 * fail.
+	 */
+	diff_io = mempool_alloc(diff_io_pool, gfp_mask);
 	if (unlikely(!diff_io))
 		return NULL;
 	memory_object_inc(memory_object_diff_io);
 
+	memset(diff_io, 0, sizeof(struct diff_io));
 	diff_io->error = 0;
 	diff_io->is_write = is_write;
 #ifdef HAVE_BIO_MAX_PAGES
@@ -99,7 +177,8 @@ struct diff_io *diff_io_new_sync(bool is_write)
 }
 
 struct diff_io *diff_io_new_async(bool is_write, bool is_nowait,
-				  void (*notify_cb)(void *ctx), void *ctx)
+				  bool is_atomic, void (*notify_cb)(void *ctx),
+				  void *ctx)
 {
 	struct diff_io *diff_io;
 
@@ -111,6 +190,7 @@ struct diff_io *diff_io_new_async(bool is_write, bool is_nowait,
 	INIT_WORK(&diff_io->notify.async.work, diff_io_notify_cb);
 	diff_io->notify.async.ctx = ctx;
 	diff_io->notify.async.notify_cb = notify_cb;
+	diff_io->notify.async.is_atomic = is_atomic;
 	return diff_io;
 }
 
@@ -119,9 +199,25 @@ static inline bool check_page_aligned(sector_t sector)
 	return !(sector & ((1ull << (PAGE_SHIFT - SECTOR_SHIFT)) - 1));
 }
 
-static inline unsigned short calc_page_count(sector_t sectors)
+/*
+ * Calculates the number of buffer segments required to transfer the
+ * specified number of sectors. Returns zero if the buffer is too small.
+ */
+static inline unsigned short calc_segment_count(struct diff_buffer *diff_buffer,
+						sector_t sectors)
 {
-	return round_up(sectors, PAGE_SECTORS) / PAGE_SECTORS;
+	size_t inx;
+	sector_t processed = 0;
+
+	for (inx = 0; inx < diff_buffer->segment_count; inx++) {
+		if (processed >= sectors)
+			break;
+		processed += PAGE_SECTORS << diff_buffer->segments[inx].order;
+	}
+	if (processed < sectors)
+		return 0;
+
+	return inx;
 }
 
 #ifdef HAVE_BIO_MAX_PAGES
@@ -131,7 +227,8 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 	int ret = 0;
 	struct bio *bio;
 	struct bio_list bio_list_head = BIO_EMPTY_LIST;
-	struct page **current_page_ptr;
+	struct diff_buffer_segment *segment;
+	unsigned short segment_count;
 	sector_t processed = 0;
 
 	if (unlikely(!check_page_aligned(diff_region->sector))) {
@@ -139,26 +236,19 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 		return -EINVAL;
 	}
 
-	if (unlikely(calc_page_count(diff_region->count) >
-		     diff_buffer->page_count)) {
+	segment_count = calc_segment_count(diff_buffer, diff_region->count);
+	if (unlikely(!segment_count)) {
 		pr_err("The difference storage block is larger than the buffer size\n");
 		return -EINVAL;
 	}
 
 	/* Append bio with datas to bio_list */
-	current_page_ptr = diff_buffer->pages;
+	segment = diff_buffer->segments;
 	while (processed < diff_region->count) {
-		sector_t offset = 0;
-		sector_t portion;
 		unsigned short nr_iovecs;
 
-		portion = diff_region->count - processed;
-		nr_iovecs = calc_page_count(portion);
-
-		if (nr_iovecs > BIO_MAX_PAGES) {
-			nr_iovecs = BIO_MAX_PAGES;
-			portion = BIO_MAX_PAGES * PAGE_SECTORS;
-		}
+		nr_iovecs = min_t(unsigned short, segment_count, BIO_MAX_PAGES);
+		segment_count -= nr_iovecs;
 
 		if (is_nowait) {
 			bio = bio_alloc_bioset(GFP_NOIO | GFP_NOWAIT, nr_iovecs,
@@ -189,12 +279,13 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 		else
 			bio_set_op_attrs(bio, REQ_OP_READ, REQ_SYNC);
 
-		while (offset < portion) {
+		while (nr_iovecs--) {
 			sector_t bvec_len_sect;
 			unsigned int bvec_len;
 
-			bvec_len_sect = min_t(sector_t, PAGE_SECTORS,
-					      portion - offset);
+			bvec_len_sect =
+				min_t(sector_t, PAGE_SECTORS << segment->order,
+				      diff_region->count - processed);
 			bvec_len =
 				(unsigned int)(bvec_len_sect << SECTOR_SHIFT);
 
@@ -202,17 +293,15 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 				ret = -EFAULT;
 				goto fail;
 			}
-			/* All pages offset aligned to PAGE_SIZE */
-			__bio_add_page(bio, *current_page_ptr, bvec_len, 0);
+			/* All segments offset aligned to PAGE_SIZE */
+			__bio_add_page(bio, segment->page, bvec_len, 0);
 
-			current_page_ptr++;
-			offset += bvec_len_sect;
+			segment++;
+			processed += bvec_len_sect;
 		}
 
 		bio_list_add(&bio_list_head, bio);
 		atomic_inc(&diff_io->bio_count);
-
-		processed += offset;
 	}
 
 	/* sumbit all bio */
@@ -235,7 +324,7 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 {
 	int ret = 0;
 	struct bio *bio = NULL;
-	struct page **current_page_ptr;
+	struct diff_buffer_segment *segment;
 	unsigned short nr_iovecs;
 	sector_t processed = 0;
 #ifdef HAVE_BDEV_BIO_ALLOC
@@ -250,8 +339,8 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 		goto fail;
 	}
 
-	nr_iovecs = calc_page_count(diff_region->count);
-	if (unlikely(nr_iovecs > diff_buffer->page_count)) {
+	nr_iovecs = calc_segment_count(diff_buffer, diff_region->count);
+	if (unlikely(!nr_iovecs)) {
 		pr_err("The difference storage block is larger than the buffer size\n");
 		ret = -EINVAL;
 		goto fail;
@@ -299,21 +388,21 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 	else
 		bio_set_op_attrs(bio, REQ_OP_READ, REQ_SYNC);
 #endif
-	current_page_ptr = diff_buffer->pages;
+	segment = diff_buffer->segments;
 	while (processed < diff_region->count) {
 		sector_t bvec_len_sect;
 		unsigned int bvec_len;
 
-		bvec_len_sect = min_t(sector_t, PAGE_SECTORS,
+		bvec_len_sect = min_t(sector_t, PAGE_SECTORS << segment->order,
 				      diff_region->count - processed);
 		bvec_len = (unsigned int)(bvec_len_sect << SECTOR_SHIFT);
 
-		if (bio_add_page(bio, *current_page_ptr, bvec_len, 0) == 0) {
+		if (bio_add_page(bio, segment->page, bvec_len, 0) == 0) {
 			bio_put(bio);
 			return -EFAULT;
 		}
 
-		current_page_ptr++;
+		segment++;
 		processed += bvec_len_sect;
 	}
 	submit_bio_noacct(bio);
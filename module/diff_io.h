@@ -47,6 +47,10 @@ struct diff_io_sync {
  *	the I/O execution is completed.
  * @ctx:
  *	The context for the callback function &notify_cb.
+ * @is_atomic:
+ *	The callback function does not sleep and can be called directly
+ *	from the bio completion handler. If the I/O fails, the callback is
+ *	still executed in the workqueue.
  *
  * Allows to schedule execution of an I/O operation.
  */
@@ -54,6 +58,7 @@ struct diff_io_async {
 	struct work_struct work;
 	void (*notify_cb)(void *ctx);
 	void *ctx;
+	bool is_atomic;
 };
 
 /**
@@ -88,12 +93,7 @@ struct diff_io {
 int diff_io_init(void);
 void diff_io_done(void);
 
-static inline void diff_io_free(struct diff_io *diff_io)
-{
-	kfree(diff_io);
-	if (diff_io)
-		memory_object_dec(memory_object_diff_io);
-}
+void diff_io_free(struct diff_io *diff_io);
 
 struct diff_io *diff_io_new_sync(bool is_write);
 static inline struct diff_io *diff_io_new_sync_read(void)
@@ -106,16 +106,23 @@ static inline struct diff_io *diff_io_new_sync_write(void)
 };
 
 struct diff_io *diff_io_new_async(bool is_write, bool is_nowait,
-				  void (*notify_cb)(void *ctx), void *ctx);
+				  bool is_atomic, void (*notify_cb)(void *ctx),
+				  void *ctx);
 static inline struct diff_io *
 diff_io_new_async_read(void (*notify_cb)(void *ctx), void *ctx, bool is_nowait)
 {
-	return diff_io_new_async(false, is_nowait, notify_cb, ctx);
+	return diff_io_new_async(false, is_nowait, false, notify_cb, ctx);
 };
 static inline struct diff_io *
 diff_io_new_async_write(void (*notify_cb)(void *ctx), void *ctx, bool is_nowait)
 {
-	return diff_io_new_async(true, is_nowait, notify_cb, ctx);
+	return diff_io_new_async(true, is_nowait, false, notify_cb, ctx);
+};
+static inline struct diff_io *
+diff_io_new_async_write_atomic(void (*notify_cb)(void *ctx), void *ctx,
+			       bool is_nowait)
+{
+	return diff_io_new_async(true, is_nowait, true, notify_cb, ctx);
 };
 
 int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
@@ -4,6 +4,13 @@
 #include <linux/sched/mm.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/hash.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blk_snap.h"
 #else
@@ -21,11 +28,39 @@
 
 /**
  * struct storage_bdev - Information about the opened block device.
+ * @link:
+ *	The list header allows to link the block devices of the difference
+ *	storage.
+ * @dev_id:
+ *	Block device ID.
+ * @bdev:
+ *	A pointer to the opened block device.
+ * @empty_blocks:
+ *	List of empty blocks on this block device. This list can be updated
+ *	while holding a snapshot. This allows us to dynamically increase the
+ *	storage size for these snapshots. The blocks are sorted by sector.
+ * @next_sector:
+ *	The sector that follows the last part reserved on this block device.
+ * @capacity:
+ *	The number of sectors appended on this block device.
+ * @filled:
+ *	The number of sectors filled in on this block device.
+ * @wasted:
+ *	The number of sectors left unused on this block device.
+ *
+ * The parts are reserved in ascending order of sectors starting from the
+ * last reserved part, so the chunks are written to the block device mostly
+ * sequentially, even if the blocks were appended in a different order.
  */
 struct storage_bdev {
 	struct list_head link;
 	dev_t dev_id;
 	struct block_device *bdev;
+	struct list_head empty_blocks;
+	sector_t next_sector;
+	sector_t capacity;
+	sector_t filled;
+	sector_t wasted;
 };
 
 /**
@@ -40,18 +75,128 @@ struct storage_block {
 	sector_t used;
 };
 
-static inline void diff_storage_event_low(struct diff_storage *diff_storage)
+/**
+ * struct storage_file - A file appended to the difference storage.
+ * @link:
+ *	The list header allows to link the files of the difference storage.
+ * @file:
+ *	The file with the pinned blocks.
+ */
+struct storage_file {
+	struct list_head link;
+	struct file *file;
+};
+
+#define DIFF_STORAGE_DEDUP_BITS 16
+
+/*
+ * The maximum number of sectors reserved for one CPU at a time. The rest of
+ * the reserved part that is too small for a region is returned to its
+ * storage block.
+ */
+#define DIFF_STORAGE_CURSOR_SECTORS (1ull << (21 - SECTOR_SHIFT))
+
+/*
+ * The size of the buffer with zeros that is used to fill in the file
+ * appended to the difference storage.
+ */
+#define DIFF_STORAGE_FILE_ZERO_SIZE (1ul << 20)
+
+/*
+ * The fill rate is calculated no more often than once per interval in
+ * jiffies. The new value is taken into the moving average with the weight
+ * 1/(2^DIFF_STORAGE_RATE_WEIGHT_SHIFT).
+ */
+#define DIFF_STORAGE_RATE_INTERVAL (HZ / 10)
+#define DIFF_STORAGE_RATE_WEIGHT_SHIFT 2
+
+static inline void diff_storage_notify_low(struct diff_storage *diff_storage,
+					   sector_t requested)
 {
 	struct blk_snap_event_low_free_space data = {
-		.requested_nr_sect = diff_storage_minimum,
+		.requested_nr_sect = requested,
 	};
 
-	diff_storage->requested += data.requested_nr_sect;
+	event_gen(diff_storage->event_queue, GFP_NOIO,
+		  blk_snap_event_code_low_free_space, &data, sizeof(data));
+}
+
+/*
+ * Should be called while holding the lock of the difference storage.
+ */
+static inline void diff_storage_update_rate(struct diff_storage *diff_storage)
+{
+	unsigned long now = jiffies;
+	unsigned long elapsed = now - diff_storage->rate_stamp;
+	sector_t rate;
+
+	if (elapsed < DIFF_STORAGE_RATE_INTERVAL)
+		return;
+
+	rate = div64_ul((diff_storage->consumed - diff_storage->rate_consumed) *
+				HZ, elapsed);
+	if (diff_storage->fill_rate)
+		rate = diff_storage->fill_rate -
+		       (diff_storage->fill_rate >> DIFF_STORAGE_RATE_WEIGHT_SHIFT) +
+		       (rate >> DIFF_STORAGE_RATE_WEIGHT_SHIFT);
+
+	diff_storage->fill_rate = rate;
+	diff_storage->rate_consumed = diff_storage->consumed;
+	diff_storage->rate_stamp = now;
+}
+
+/*
+ * The portion of the difference storage that should be enough for the
+ * diff_storage_horizon seconds at the current fill rate.
+ */
+static inline sector_t diff_storage_portion(struct diff_storage *diff_storage)
+{
+	return max_t(sector_t, diff_storage_minimum,
+		     diff_storage->fill_rate * max(diff_storage_horizon, 0));
+}
+
+static inline void diff_storage_event_low(struct diff_storage *diff_storage,
+					  sector_t portion)
+{
+	diff_storage->requested += portion;
 	pr_debug(
 		"Diff storage low free space. Portion: %llu sectors, requested: %llu\n",
-		data.requested_nr_sect, diff_storage->requested);
-	event_gen(&diff_storage->event_queue, GFP_NOIO,
-		  blk_snap_event_code_low_free_space, &data, sizeof(data));
+		portion, diff_storage->requested);
+
+	diff_storage_notify_low(diff_storage, portion);
+}
+
+static inline void diff_storage_update_low_space(struct diff_storage *diff_storage)
+{
+	if (atomic_read(&diff_storage->low_space_flag) &&
+	    (diff_storage->capacity >= diff_storage->requested))
+		atomic_set(&diff_storage->low_space_flag, 0);
+}
+
+/*
+ * The blocks of the file are pinned like the blocks of a swap file. The
+ * file systems do not allow to write, truncate or move the blocks of such
+ * a file. The file remains pinned until the difference storage is freed.
+ */
+static inline int diff_storage_pin_file(struct inode *inode)
+{
+	int ret = 0;
+
+	inode_lock(inode);
+	if (IS_SWAPFILE(inode))
+		ret = -ETXTBSY;
+	else
+		inode->i_flags |= S_SWAPFILE;
+	inode_unlock(inode);
+
+	return ret;
+}
+
+static inline void diff_storage_unpin_file(struct inode *inode)
+{
+	inode_lock(inode);
+	inode->i_flags &= ~S_SWAPFILE;
+	inode_unlock(inode);
 }
 
 struct diff_storage *diff_storage_new(void)
@@ -63,22 +208,50 @@ struct diff_storage *diff_storage_new(void)
 		return NULL;
 	memory_object_inc(memory_object_diff_storage);
 
+	diff_storage->event_queue = event_queue_new();
+	if (!diff_storage->event_queue) {
+		kfree(diff_storage);
+		memory_object_dec(memory_object_diff_storage);
+		return NULL;
+	}
+
+	diff_storage->cursors = alloc_percpu(struct diff_storage_cursor);
+	if (!diff_storage->cursors) {
+		event_queue_put(diff_storage->event_queue);
+		kfree(diff_storage);
+		memory_object_dec(memory_object_diff_storage);
+		return NULL;
+	}
+
 	kref_init(&diff_storage->kref);
 	spin_lock_init(&diff_storage->lock);
 	INIT_LIST_HEAD(&diff_storage->storage_bdevs);
-	INIT_LIST_HEAD(&diff_storage->empty_blocks);
 	INIT_LIST_HEAD(&diff_storage->filled_blocks);
+	mutex_init(&diff_storage->file_lock);
+	INIT_LIST_HEAD(&diff_storage->storage_files);
+	spin_lock_init(&diff_storage->dedup_lock);
+
+	if (chunk_deduplication) {
+		diff_storage->dedup_table =
+			kvcalloc(1 << DIFF_STORAGE_DEDUP_BITS,
+				 sizeof(struct hlist_head), GFP_KERNEL);
+		if (diff_storage->dedup_table)
+			memory_object_inc(memory_object_dedup_table);
+		else
+			pr_warn("Deduplication is disabled due to lack of memory\n");
+	}
 
-	event_queue_init(&diff_storage->event_queue);
-	diff_storage_event_low(diff_storage);
+	diff_storage->rate_stamp = jiffies;
+
+	diff_storage_event_low(diff_storage, diff_storage_minimum);
 
 	return diff_storage;
 }
 
 static inline struct storage_block *
-first_empty_storage_block(struct diff_storage *diff_storage)
+first_empty_storage_block(struct storage_bdev *storage_bdev)
 {
-	return list_first_entry_or_null(&diff_storage->empty_blocks,
+	return list_first_entry_or_null(&storage_bdev->empty_blocks,
 					struct storage_block, link);
 };
 
@@ -102,11 +275,33 @@ void diff_storage_free(struct kref *kref)
 		container_of(kref, struct diff_storage, kref);
 	struct storage_block *blk;
 	struct storage_bdev *storage_bdev;
+	struct storage_file *storage_file;
 
-	while ((blk = first_empty_storage_block(diff_storage))) {
-		list_del(&blk->link);
-		kfree(blk);
-		memory_object_dec(memory_object_storage_block);
+	while ((storage_file = list_first_entry_or_null(
+			&diff_storage->storage_files, struct storage_file,
+			link))) {
+		list_del(&storage_file->link);
+		diff_storage_unpin_file(file_inode(storage_file->file));
+		fput(storage_file->file);
+		kfree(storage_file);
+		memory_object_dec(memory_object_storage_file);
+	}
+
+	if (diff_storage->dedup_table) {
+		unsigned int inx;
+
+		for (inx = 0; inx < (1 << DIFF_STORAGE_DEDUP_BITS); inx++) {
+			struct diff_storage_dedup *dedup;
+			struct hlist_node *tmp;
+
+			hlist_for_each_entry_safe(dedup, tmp,
+				&diff_storage->dedup_table[inx], link) {
+				hlist_del(&dedup->link);
+				diff_storage_dedup_free(dedup);
+			}
+		}
+		kvfree(diff_storage->dedup_table);
+		memory_object_dec(memory_object_dedup_table);
 	}
 
 	while ((blk = first_filled_storage_block(diff_storage))) {
@@ -116,36 +311,43 @@ void diff_storage_free(struct kref *kref)
 	}
 
 	while ((storage_bdev = first_storage_bdev(diff_storage))) {
+		while ((blk = first_empty_storage_block(storage_bdev))) {
+			list_del(&blk->link);
+			kfree(blk);
+			memory_object_dec(memory_object_storage_block);
+		}
+
 		blkdev_put(storage_bdev->bdev, FMODE_READ | FMODE_WRITE);
 		list_del(&storage_bdev->link);
 		kfree(storage_bdev);
 		memory_object_dec(memory_object_storage_bdev);
 	}
-	event_queue_done(&diff_storage->event_queue);
+	event_queue_put(diff_storage->event_queue);
+	free_percpu(diff_storage->cursors);
 
 	kfree(diff_storage);
 	memory_object_dec(memory_object_diff_storage);
 }
 
-static struct block_device *
+static struct storage_bdev *
 diff_storage_bdev_by_id(struct diff_storage *diff_storage, dev_t dev_id)
 {
-	struct block_device *bdev = NULL;
+	struct storage_bdev *found = NULL;
 	struct storage_bdev *storage_bdev;
 
 	spin_lock(&diff_storage->lock);
 	list_for_each_entry(storage_bdev, &diff_storage->storage_bdevs, link) {
 		if (storage_bdev->dev_id == dev_id) {
-			bdev = storage_bdev->bdev;
+			found = storage_bdev;
 			break;
 		}
 	}
 	spin_unlock(&diff_storage->lock);
 
-	return bdev;
+	return found;
 }
 
-static inline struct block_device *
+static inline struct storage_bdev *
 diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 {
 	struct block_device *bdev;
@@ -155,7 +357,7 @@ diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 	if (IS_ERR(bdev)) {
 		pr_err("Failed to open device. errno=%d\n",
 		       abs((int)PTR_ERR(bdev)));
-		return bdev;
+		return ERR_PTR(PTR_ERR(bdev));
 	}
 
 	storage_bdev = kzalloc(sizeof(struct storage_bdev), GFP_KERNEL);
@@ -168,19 +370,37 @@ diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 	storage_bdev->bdev = bdev;
 	storage_bdev->dev_id = dev_id;
 	INIT_LIST_HEAD(&storage_bdev->link);
+	INIT_LIST_HEAD(&storage_bdev->empty_blocks);
 
 	spin_lock(&diff_storage->lock);
 	list_add_tail(&storage_bdev->link, &diff_storage->storage_bdevs);
+	diff_storage->storage_bdev_count++;
+	if (!diff_storage->next_storage_bdev)
+		diff_storage->next_storage_bdev = storage_bdev;
 	spin_unlock(&diff_storage->lock);
 
-	return bdev;
+	return storage_bdev;
+}
+
+static inline struct storage_bdev *
+diff_storage_get_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
+{
+	struct storage_bdev *storage_bdev;
+
+	storage_bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
+	if (storage_bdev)
+		return storage_bdev;
+
+	return diff_storage_add_storage_bdev(diff_storage, dev_id);
 }
 
 static inline int diff_storage_add_range(struct diff_storage *diff_storage,
-					 struct block_device *bdev,
+					 struct storage_bdev *storage_bdev,
 					 sector_t sector, sector_t count)
 {
 	struct storage_block *storage_block;
+	struct storage_block *prev;
+	struct block_device *bdev = storage_bdev->bdev;
 
 	pr_debug("Add range to diff storage: [%u:%u] %llu:%llu\n",
 		 MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev), sector, count);
@@ -196,12 +416,33 @@ static inline int diff_storage_add_range(struct diff_storage *diff_storage,
 	storage_block->count = count;
 
 	spin_lock(&diff_storage->lock);
-	list_add_tail(&storage_block->link, &diff_storage->empty_blocks);
+	/*
+	 * The ranges are usually appended in ascending order, so the
+	 * position is searched from the end of the list.
+	 */
+	list_for_each_entry_reverse(prev, &storage_bdev->empty_blocks, link) {
+		if (prev->sector < sector)
+			break;
+	}
+	if ((&prev->link != &storage_bdev->empty_blocks) &&
+	    ((prev->sector + prev->count) == sector)) {
+		/* The range continues the previous block. */
+		prev->count += count;
+	} else {
+		list_add(&storage_block->link, &prev->link);
+		storage_block = NULL;
 #ifdef BLK_SNAP_DEBUG_DIFF_STORAGE_LISTS
-	atomic_inc(&diff_storage->free_block_count);
+		atomic_inc(&diff_storage->free_block_count);
 #endif
+	}
 	diff_storage->capacity += count;
+	storage_bdev->capacity += count;
 	spin_unlock(&diff_storage->lock);
+
+	if (storage_block) {
+		kfree(storage_block);
+		memory_object_dec(memory_object_storage_block);
+	}
 #ifdef BLK_SNAP_DEBUG_DIFF_STORAGE_LISTS
 	pr_debug("free storage blocks %d\n",
 		 atomic_read(&diff_storage->free_block_count));
@@ -216,74 +457,269 @@ int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
 {
 	int ret;
 	int inx;
-	struct block_device *bdev;
+	struct storage_bdev *storage_bdev;
 	struct blk_snap_block_range range;
 	const unsigned long range_size = sizeof(struct blk_snap_block_range);
 
 	pr_debug("Append %u blocks\n", range_count);
 
-	bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
-	if (!bdev) {
-		bdev = diff_storage_add_storage_bdev(diff_storage, dev_id);
-		if (IS_ERR(bdev))
-			return PTR_ERR(bdev);
-	}
+	storage_bdev = diff_storage_get_storage_bdev(diff_storage, dev_id);
+	if (IS_ERR(storage_bdev))
+		return PTR_ERR(storage_bdev);
 
 	for (inx = 0; inx < range_count; inx++) {
 		if (unlikely(copy_from_user(&range, ranges+inx, range_size)))
 			return -EINVAL;
 
-		ret = diff_storage_add_range(diff_storage, bdev,
+		ret = diff_storage_add_range(diff_storage, storage_bdev,
 					     range.sector_offset,
 					     range.sector_count);
 		if (unlikely(ret))
 			return ret;
 	}
 
-	if (atomic_read(&diff_storage->low_space_flag) &&
-	    (diff_storage->capacity >= diff_storage->requested))
-		atomic_set(&diff_storage->low_space_flag, 0);
-
+	diff_storage_update_low_space(diff_storage);
 	return 0;
 }
 
-struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
-					   sector_t count)
+static int diff_storage_zero_file(struct file *file, loff_t from, loff_t to)
 {
-	int ret = 0;
-	struct diff_region *diff_region;
-	sector_t sectors_left;
+	void *zero;
+	ssize_t written = 0;
 
-	if (atomic_read(&diff_storage->overflow_flag))
-		return ERR_PTR(-ENOSPC);
+	zero = kvzalloc(DIFF_STORAGE_FILE_ZERO_SIZE, GFP_KERNEL);
+	if (!zero)
+		return -ENOMEM;
 
-	diff_region = kzalloc(sizeof(struct diff_region), GFP_NOIO);
-	if (!diff_region)
-		return ERR_PTR(-ENOMEM);
-	memory_object_inc(memory_object_diff_region);
+	while (from < to) {
+		size_t count = min_t(loff_t, to - from,
+				     DIFF_STORAGE_FILE_ZERO_SIZE);
 
-	spin_lock(&diff_storage->lock);
-	do {
-		struct storage_block *storage_block;
-		sector_t available;
-
-		storage_block = first_empty_storage_block(diff_storage);
-		if (unlikely(!storage_block)) {
-			atomic_inc(&diff_storage->overflow_flag);
-			ret = -ENOSPC;
+		written = kernel_write(file, zero, count, &from);
+		if (written < 0)
 			break;
+	}
+	kvfree(zero);
+
+	return (written < 0) ? written : 0;
+}
+
+/*
+ * Maps the pages of the file to the ranges of sectors on the block device,
+ * as it is done for a swap file. The pages that are not aligned or not
+ * contiguous on the block device are skipped. The contiguous pages are
+ * merged into one range. Since the file has been written and synced, a block
+ * that is not mapped means that the file system cannot provide the stable
+ * extents of the file, as is the case with the files that share their
+ * extents with other files.
+ */
+static int diff_storage_map_file(struct diff_storage *diff_storage,
+				 struct storage_bdev *storage_bdev,
+				 struct inode *inode, loff_t from, loff_t to)
+{
+	int ret = 0;
+	const unsigned int blkbits = inode->i_blkbits;
+	const unsigned int blocks_per_page = 1 << (PAGE_SHIFT - blkbits);
+	const sector_t page_sectors = PAGE_SIZE >> SECTOR_SHIFT;
+	sector_t range_sector = 0;
+	sector_t range_count = 0;
+	loff_t pos;
+
+	for (pos = from; pos < to; pos += PAGE_SIZE) {
+		sector_t first_block = pos >> blkbits;
+		sector_t block;
+		sector_t sector;
+		unsigned int inx;
+
+		ret = bmap(inode, &first_block);
+		if (ret)
+			return ret;
+		if (!first_block)
+			return -EOPNOTSUPP;
+		if (first_block & (blocks_per_page - 1))
+			continue;
+
+		for (inx = 1; inx < blocks_per_page; inx++) {
+			block = (pos >> blkbits) + inx;
+			ret = bmap(inode, &block);
+			if (ret)
+				return ret;
+			if (block != first_block + inx)
+				break;
+		}
+		if (inx < blocks_per_page)
+			continue;
+
+		sector = first_block << (blkbits - SECTOR_SHIFT);
+		if (range_count && (range_sector + range_count == sector)) {
+			range_count += page_sectors;
+			continue;
+		}
+
+		if (range_count) {
+			ret = diff_storage_add_range(diff_storage, storage_bdev,
+						     range_sector, range_count);
+			if (ret)
+				return ret;
 		}
+		range_sector = sector;
+		range_count = page_sectors;
+	}
+
+	if (range_count)
+		ret = diff_storage_add_range(diff_storage, storage_bdev,
+					     range_sector, range_count);
+	return ret;
+}
+
+/*
+ * The file is allocated and filled in with zeros, since the bmap operation
+ * does not map the unwritten extents. The file does not belong to the
+ * difference storage yet, so it is not pinned while it is being written.
+ */
+static int diff_storage_allocate_file(struct file *file, loff_t size)
+{
+	int ret;
+
+	ret = vfs_fallocate(file, 0, 0, size);
+	if (!ret)
+		ret = diff_storage_zero_file(file, 0, size);
+	if (!ret)
+		ret = vfs_fsync(file, 0);
+	return ret;
+}
+
+/**
+ * diff_storage_append_file() - Appends a file to the difference storage.
+ * @diff_storage:
+ *	The difference storage.
+ * @file:
+ *	A regular file opened for writing.
+ * @sector_count:
+ *	The size of the file in sectors.
+ *
+ * The file is allocated and pinned before its blocks are appended to the
+ * difference storage, and is never unpinned while the difference storage
+ * exists. A pinned file cannot be grown, so the difference storage is
+ * extended by appending the next file.
+ */
+int diff_storage_append_file(struct diff_storage *diff_storage,
+			     struct file *file, sector_t sector_count)
+{
+	int ret;
+	struct inode *inode = file_inode(file);
+	struct storage_bdev *storage_bdev;
+	struct storage_file *storage_file;
+	loff_t size = round_up(sector_count << SECTOR_SHIFT, PAGE_SIZE);
 
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!S_ISREG(inode->i_mode) || !inode->i_sb->s_bdev ||
+	    (inode->i_blkbits > PAGE_SHIFT) || !sector_count)
+		return -EINVAL;
+	if (!file->f_mapping->a_ops->bmap)
+		return -EOPNOTSUPP;
+	if (IS_SWAPFILE(inode)) {
+		pr_err("The file is already in use as a swap file\n");
+		return -ETXTBSY;
+	}
+
+	storage_bdev = diff_storage_get_storage_bdev(diff_storage,
+						     inode->i_sb->s_bdev->bd_dev);
+	if (IS_ERR(storage_bdev))
+		return PTR_ERR(storage_bdev);
+
+	pr_debug("Append file of %lld bytes to difference storage\n", size);
+	ret = diff_storage_allocate_file(file, size);
+	if (ret)
+		return ret;
+
+	storage_file = kzalloc(sizeof(struct storage_file), GFP_KERNEL);
+	if (!storage_file)
+		return -ENOMEM;
+	memory_object_inc(memory_object_storage_file);
+
+	ret = diff_storage_pin_file(inode);
+	if (ret) {
+		pr_err("The file is already in use as a swap file\n");
+		kfree(storage_file);
+		memory_object_dec(memory_object_storage_file);
+		return ret;
+	}
+	storage_file->file = get_file(file);
+
+	/*
+	 * Even if not all the pages have been mapped, the ranges that have
+	 * already been appended belong to the difference storage, so the
+	 * file remains pinned anyway.
+	 */
+	mutex_lock(&diff_storage->file_lock);
+	list_add_tail(&storage_file->link, &diff_storage->storage_files);
+	ret = diff_storage_map_file(diff_storage, storage_bdev, inode, 0, size);
+	mutex_unlock(&diff_storage->file_lock);
+	if (ret) {
+		pr_err("Failed to append file to difference storage. errno=%d\n",
+		       abs(ret));
+		return ret;
+	}
+
+	diff_storage_update_low_space(diff_storage);
+	return 0;
+}
+
+static inline struct storage_bdev *
+next_storage_bdev(struct diff_storage *diff_storage,
+		  struct storage_bdev *storage_bdev)
+{
+	if (list_is_last(&storage_bdev->link, &diff_storage->storage_bdevs))
+		return first_storage_bdev(diff_storage);
+
+	return list_next_entry(storage_bdev, link);
+};
+
+/*
+ * The parts reserved for the CPUs are counted as filled. So that the
+ * low free space event is not generated too early on the systems with many
+ * CPUs, the parts reserved for all CPUs together do not exceed the portion
+ * by which the difference storage is appended.
+ */
+static inline sector_t
+diff_storage_cursor_sectors(struct diff_storage *diff_storage)
+{
+	return min_t(sector_t, DIFF_STORAGE_CURSOR_SECTORS,
+		     div_u64(diff_storage_portion(diff_storage),
+			     num_online_cpus()));
+}
+
+/*
+ * Reserves a part of the storage on the block device. The part is not
+ * smaller than count. The first suitable block that follows the last
+ * reserved part is used. If there is no such block, the search wraps
+ * around to the beginning of the block device. Should be called while
+ * holding the lock of the difference storage.
+ */
+static bool storage_bdev_reserve(struct diff_storage *diff_storage,
+				 struct storage_bdev *storage_bdev,
+				 sector_t count,
+				 struct diff_storage_cursor *cursor)
+{
+	struct storage_block *storage_block;
+	struct storage_block *tmp;
+	struct storage_block *found = NULL;
+	sector_t available;
+
+	list_for_each_entry_safe(storage_block, tmp,
+				 &storage_bdev->empty_blocks, link) {
 		available = storage_block->count - storage_block->used;
 		if (likely(available >= count)) {
-			diff_region->bdev = storage_block->bdev;
-			diff_region->sector =
-				storage_block->sector + storage_block->used;
-			diff_region->count = count;
-
-			storage_block->used += count;
-			diff_storage->filled += count;
-			break;
+			if (!found)
+				found = storage_block;
+			if ((storage_block->sector + storage_block->used) >=
+			    storage_bdev->next_sector) {
+				found = storage_block;
+				break;
+			}
+			continue;
 		}
 
 		list_del(&storage_block->link);
@@ -301,8 +737,66 @@ struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
 		 * to accommodate several pieces entirely.
 		 */
 		diff_storage->filled += available;
-	} while (1);
-	sectors_left = diff_storage->requested - diff_storage->filled;
+		diff_storage->consumed += available;
+		diff_storage->wasted += available;
+		storage_bdev->filled += available;
+		storage_bdev->wasted += available;
+	}
+
+	if (!found)
+		return false;
+
+	available = found->count - found->used;
+	count = min(available, max(count, diff_storage_cursor_sectors(
+						  diff_storage)));
+
+	cursor->bdev = found->bdev;
+	cursor->sector = found->sector + found->used;
+	cursor->count = count;
+
+	found->used += count;
+	diff_storage->filled += count;
+	diff_storage->consumed += count;
+	storage_bdev->filled += count;
+	storage_bdev->next_sector = cursor->sector + count;
+	return true;
+}
+
+/*
+ * The parts are reserved on the block devices of the difference storage
+ * in turn. So the chunks that are stored at the same time by different
+ * CPUs are written to different block devices in parallel.
+ */
+static int diff_storage_reserve(struct diff_storage *diff_storage,
+				sector_t count,
+				struct diff_storage_cursor *cursor)
+{
+	int ret = -ENOSPC;
+	unsigned int inx;
+	struct storage_bdev *storage_bdev;
+	sector_t sectors_left;
+	sector_t portion;
+
+	spin_lock(&diff_storage->lock);
+	storage_bdev = diff_storage->next_storage_bdev;
+	for (inx = 0; storage_bdev && (inx < diff_storage->storage_bdev_count);
+	     inx++) {
+		struct storage_bdev *current_bdev = storage_bdev;
+
+		storage_bdev = next_storage_bdev(diff_storage, storage_bdev);
+		if (storage_bdev_reserve(diff_storage, current_bdev, count,
+					 cursor)) {
+			diff_storage->next_storage_bdev = storage_bdev;
+			ret = 0;
+			break;
+		}
+	}
+	if (unlikely(ret))
+		atomic_inc(&diff_storage->overflow_flag);
+	diff_storage_update_rate(diff_storage);
+	portion = diff_storage_portion(diff_storage);
+	sectors_left = max(diff_storage->requested, diff_storage->capacity) -
+		       diff_storage->filled;
 	spin_unlock(&diff_storage->lock);
 
 #ifdef BLK_SNAP_DEBUG_DIFF_STORAGE_LISTS
@@ -311,16 +805,292 @@ struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
 	pr_debug("user storage blocks %d\n",
 		 atomic_read(&diff_storage->user_block_count));
 #endif
-
 	if (ret) {
 		pr_err("Cannot get empty storage block\n");
-		diff_storage_free_region(diff_region);
-		return ERR_PTR(ret);
+		return ret;
 	}
 
-	if ((sectors_left <= diff_storage_minimum) &&
+	/*
+	 * The event is generated in advance, so that the user space has time
+	 * to append the requested portion before the free space runs out.
+	 */
+	if ((sectors_left <= portion) &&
 	    (atomic_inc_return(&diff_storage->low_space_flag) == 1))
-		diff_storage_event_low(diff_storage);
+		diff_storage_event_low(diff_storage, portion);
+
+	return 0;
+}
+
+/*
+ * Returns the unused rest of the reserved part. If nothing has been reserved
+ * in its storage block after it, the rest is returned to the block. Otherwise
+ * it is left unused.
+ */
+static void diff_storage_cursor_release(struct diff_storage *diff_storage,
+					struct diff_storage_cursor *cursor)
+{
+	struct storage_bdev *storage_bdev = NULL;
+	struct storage_bdev *tmp;
+	struct storage_block *storage_block;
+	sector_t end = cursor->sector + cursor->count;
+
+	spin_lock(&diff_storage->lock);
+	list_for_each_entry(tmp, &diff_storage->storage_bdevs, link) {
+		if (tmp->bdev == cursor->bdev) {
+			storage_bdev = tmp;
+			break;
+		}
+	}
+	if (WARN_ON(!storage_bdev))
+		goto out_unlock;
+
+	list_for_each_entry(storage_block, &storage_bdev->empty_blocks, link) {
+		if ((storage_block->sector + storage_block->used) == end) {
+			storage_block->used -= cursor->count;
+			diff_storage->filled -= cursor->count;
+			storage_bdev->filled -= cursor->count;
+			if (storage_bdev->next_sector == end)
+				storage_bdev->next_sector = cursor->sector;
+			goto out_unlock;
+		}
+	}
+
+	diff_storage->wasted += cursor->count;
+	storage_bdev->wasted += cursor->count;
+out_unlock:
+	spin_unlock(&diff_storage->lock);
+}
+
+static inline void diff_storage_cursor_take(struct diff_storage_cursor *cursor,
+					    sector_t count,
+					    struct diff_region *diff_region)
+{
+	diff_region->bdev = cursor->bdev;
+	diff_region->sector = cursor->sector;
+	diff_region->count = count;
+
+	cursor->sector += count;
+	cursor->count -= count;
+}
+
+/**
+ * diff_storage_new_region() - Allocates a region in the difference storage.
+ * @diff_storage:
+ *	The difference storage.
+ * @count:
+ *	The number of sectors in the region.
+ * @diff_region:
+ *	The region to fill in.
+ */
+int diff_storage_new_region(struct diff_storage *diff_storage, sector_t count,
+			    struct diff_region *diff_region)
+{
+	int ret;
+	struct diff_storage_cursor *cursor;
+	struct diff_storage_cursor reserved;
+
+	if (atomic_read(&diff_storage->overflow_flag))
+		return -ENOSPC;
+
+	cursor = get_cpu_ptr(diff_storage->cursors);
+	if (likely(cursor->count >= count)) {
+		diff_storage_cursor_take(cursor, count, diff_region);
+		put_cpu_ptr(diff_storage->cursors);
+		return 0;
+	}
+	put_cpu_ptr(diff_storage->cursors);
+
+	/*
+	 * The rest of the reserved part is too small. Reserving a new part
+	 * can generate an event, so it cannot be done with the preemption
+	 * disabled.
+	 */
+	ret = diff_storage_reserve(diff_storage, count, &reserved);
+	if (ret)
+		return ret;
+
+	diff_storage_cursor_take(&reserved, count, diff_region);
+
+	/*
+	 * The larger of the two parts is kept for the CPU and the smaller
+	 * one is released.
+	 */
+	cursor = get_cpu_ptr(diff_storage->cursors);
+	if (reserved.count > cursor->count)
+		swap(*cursor, reserved);
+	put_cpu_ptr(diff_storage->cursors);
+
+	if (reserved.count)
+		diff_storage_cursor_release(diff_storage, &reserved);
+
+	return 0;
+}
+
+/**
+ * diff_storage_get_stat() - Gets the statistics of the difference storage.
+ * @diff_storage:
+ *	The difference storage.
+ * @stat:
+ *	The structure to fill in.
+ */
+void diff_storage_get_stat(struct diff_storage *diff_storage,
+			   struct blk_snap_snapshot_storage_stat *stat)
+{
+	spin_lock(&diff_storage->lock);
+	stat->capacity = diff_storage->capacity;
+	stat->filled = diff_storage->filled;
+	stat->requested = diff_storage->requested;
+	stat->fill_rate = diff_storage->fill_rate;
+	spin_unlock(&diff_storage->lock);
+}
+
+/**
+ * diff_storage_get_usage() - Gets the usage of the difference storage.
+ * @diff_storage:
+ *	The difference storage.
+ * @usage:
+ *	The structure to fill in the totals.
+ * @dev_usage_array:
+ *	The array to fill in the usage of each block device. May be NULL.
+ * @count:
+ *	The number of elements in the array.
+ *
+ * Returns the number of block devices of the difference storage. If it is
+ * greater than count, only count elements of the array are filled in.
+ */
+unsigned int diff_storage_get_usage(struct diff_storage *diff_storage,
+			struct blk_snap_snapshot_storage_usage *usage,
+			struct blk_snap_storage_dev_usage *dev_usage_array,
+			unsigned int count)
+{
+	unsigned int inx = 0;
+	struct storage_bdev *storage_bdev;
+
+	spin_lock(&diff_storage->lock);
+	usage->capacity = diff_storage->capacity;
+	usage->filled = diff_storage->filled;
+	usage->requested = diff_storage->requested;
+	usage->wasted = diff_storage->wasted;
+
+	list_for_each_entry(storage_bdev, &diff_storage->storage_bdevs, link) {
+		if (dev_usage_array && (inx < count)) {
+			struct blk_snap_storage_dev_usage *dev_usage =
+				&dev_usage_array[inx];
+
+			dev_usage->dev_id.mj = MAJOR(storage_bdev->dev_id);
+			dev_usage->dev_id.mn = MINOR(storage_bdev->dev_id);
+			dev_usage->capacity = storage_bdev->capacity;
+			dev_usage->filled = storage_bdev->filled;
+			dev_usage->wasted = storage_bdev->wasted;
+		}
+		inx++;
+	}
+	spin_unlock(&diff_storage->lock);
+
+	return inx;
+}
+
+struct diff_storage_dedup *diff_storage_dedup_new(u64 hash, size_t size,
+						  bool is_compressed)
+{
+	struct diff_storage_dedup *dedup;
+
+	dedup = kzalloc(sizeof(struct diff_storage_dedup), GFP_NOIO);
+	if (!dedup)
+		return NULL;
+	memory_object_inc(memory_object_dedup_entry);
+
+	INIT_HLIST_NODE(&dedup->link);
+	dedup->hash = hash;
+	dedup->size = size;
+	dedup->is_compressed = is_compressed;
+
+	return dedup;
+}
+
+void diff_storage_dedup_free(struct diff_storage_dedup *dedup)
+{
+	if (!dedup)
+		return;
+
+	kfree(dedup);
+	memory_object_dec(memory_object_dedup_entry);
+}
+
+/**
+ * diff_storage_dedup_lookup() - Finds the region with the same data.
+ * @diff_storage:
+ *	The difference storage.
+ * @dedup:
+ *	The entry for the data that is going to be stored.
+ * @prev:
+ *	The region found by the previous call or NULL to start from the
+ *	beginning.
+ * @diff_region:
+ *	The region to fill in.
+ *
+ * The entry with the same hash may describe other data, so the caller
+ * should compare the data of the region before using it. If the data
+ * differs, the lookup is continued from the region that has been compared.
+ */
+bool diff_storage_dedup_lookup(struct diff_storage *diff_storage,
+			       struct diff_storage_dedup *dedup,
+			       struct diff_region *prev,
+			       struct diff_region *diff_region)
+{
+	bool found = false;
+	bool skip = !!prev;
+	unsigned long flags;
+	struct diff_storage_dedup *entry;
+
+	spin_lock_irqsave(&diff_storage->dedup_lock, flags);
+	hlist_for_each_entry(entry,
+		&diff_storage->dedup_table[hash_64(dedup->hash,
+						   DIFF_STORAGE_DEDUP_BITS)],
+		link) {
+		if (skip) {
+			if ((entry->diff_region.bdev == prev->bdev) &&
+			    (entry->diff_region.sector == prev->sector))
+				skip = false;
+			continue;
+		}
+		if ((entry->hash == dedup->hash) &&
+		    (entry->size == dedup->size) &&
+		    (entry->is_compressed == dedup->is_compressed)) {
+			*diff_region = entry->diff_region;
+			found = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&diff_storage->dedup_lock, flags);
+
+	return found;
+}
+
+/**
+ * diff_storage_dedup_add() - Adds the region to the deduplication index.
+ * @diff_storage:
+ *	The difference storage.
+ * @dedup:
+ *	The entry for the stored data. The index takes ownership of it.
+ * @diff_region:
+ *	The region that the data has been written to.
+ *
+ * The function is called when the data has already been written, so the
+ * region can be read by other chunks. It can be called from the I/O
+ * completion handler.
+ */
+void diff_storage_dedup_add(struct diff_storage *diff_storage,
+			    struct diff_storage_dedup *dedup,
+			    struct diff_region *diff_region)
+{
+	unsigned long flags;
+
+	dedup->diff_region = *diff_region;
 
-	return diff_region;
+	spin_lock_irqsave(&diff_storage->dedup_lock, flags);
+	hlist_add_head(&dedup->link,
+		&diff_storage->dedup_table[hash_64(dedup->hash,
+						   DIFF_STORAGE_DEDUP_BITS)]);
+	spin_unlock_irqrestore(&diff_storage->dedup_lock, flags);
 }
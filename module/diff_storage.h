@@ -2,10 +2,62 @@
 #ifndef __BLK_SNAP_DIFF_STORAGE_H
 #define __BLK_SNAP_DIFF_STORAGE_H
 
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include "event_queue.h"
+#include "diff_io.h"
 
 struct blk_snap_block_range;
-struct diff_region;
+struct blk_snap_snapshot_storage_stat;
+struct blk_snap_snapshot_storage_usage;
+struct blk_snap_storage_dev_usage;
+struct storage_bdev;
+struct diff_buffer;
+
+/**
+ * struct diff_storage_dedup - An entry of the deduplication index.
+ * @link:
+ *	The list header allows to link the entries in the bucket of the
+ *	hash table.
+ * @hash:
+ *	The hash of the chunk data as it is stored.
+ * @size:
+ *	The size of the stored data in bytes.
+ * @is_compressed:
+ *	The data is compressed.
+ * @diff_region:
+ *	The region of the difference storage with the data.
+ * @diff_buffer:
+ *	The buffer into which the data of the found region is read to be
+ *	compared. It is used only while the chunk is being stored.
+ *
+ * The regions are never released or overwritten while the difference
+ * storage exists, so the entry remains valid until the storage is freed.
+ */
+struct diff_storage_dedup {
+	struct hlist_node link;
+	u64 hash;
+	size_t size;
+	bool is_compressed;
+	struct diff_region diff_region;
+	struct diff_buffer *diff_buffer;
+};
+
+/**
+ * struct diff_storage_cursor - The part of the difference storage reserved
+ *	for allocating regions on one CPU.
+ * @bdev:
+ *	The block device of the reserved part.
+ * @sector:
+ *	The first free sector of the reserved part.
+ * @count:
+ *	The number of free sectors in the reserved part.
+ */
+struct diff_storage_cursor {
+	struct block_device *bdev;
+	sector_t sector;
+	sector_t count;
+};
 
 /**
  * struct diff_storage - Difference storage.
@@ -19,10 +71,12 @@ struct diff_region;
  *	located on different block devices. So, all opened block devices are
  *	located in this list. Blocks on opened block devices are allocated for
  *	storing the chunks data.
- * @empty_blocks:
- *	List of empty blocks on storage. This list can be updated while
- *	holding a snapshot. This allows us to dynamically increase the
- *	storage size for these snapshots.
+ * @storage_bdev_count:
+ *	The number of block devices in the list.
+ * @next_storage_bdev:
+ *	The block device on which the next part will be reserved.
+ * @cursors:
+ *	Per-CPU reserved parts of the difference storage.
  * @filled_blocks:
  *	List of filled blocks. When the blocks from the list of empty blocks are filled,
  *	we move them to the list of filled blocks.
@@ -32,39 +86,91 @@ struct diff_region;
  *	The number of sectors already filled in.
  * @requested:
  *	The number of sectors already requested from user space.
+ * @wasted:
+ *	The number of sectors left unused at the ends of the blocks that were
+ *	moved to the list of filled blocks. They are counted as filled.
+ * @consumed:
+ *	The number of sectors ever taken from the empty blocks. Unlike the
+ *	filled sectors, it is not decreased when the rest of a reserved part
+ *	is returned, so the fill rate is calculated from it.
+ * @rate_stamp:
+ *	The time in jiffies when the fill rate was calculated.
+ * @rate_consumed:
+ *	The number of consumed sectors when the fill rate was calculated.
+ * @fill_rate:
+ *	The moving average of the number of sectors filled per second.
  * @low_space_flag:
  *	The flag is set if the number of free regions available in the
- *	difference storage is less than the allowed minimum.
+ *	difference storage is less than the portion that should be enough
+ *	for the next few seconds at the current fill rate.
  * @overflow_flag:
  *	The request for a free region failed due to the absence of free
  *	regions in the difference storage.
  * @event_queue:
  *	A queue of events to pass events to user space. Diff storage and its
  *	owner can notify its snapshot about events like snapshot overflow,
- *	low free space and snapshot terminated.
+ *	low free space and snapshot terminated. The queue can outlive the
+ *	difference storage while the file of the events is open.
+ * @file_lock:
+ *	The mutex serializes the appending of the files.
+ * @storage_files:
+ *	List of the files appended to the difference storage by their
+ *	descriptors.
+ * @dedup_lock:
+ *	The spinlock protects the deduplication index. The entries are added
+ *	from the I/O completion handler.
+ * @dedup_table:
+ *	The hash table of the regions with the stored chunks. It is allocated
+ *	only if the deduplication is enabled.
  *
  * The difference storage manages the regions of block devices that are used
  * to store the data of the original block devices in the snapshot.
  * The difference storage is created one per snapshot and is used to store
  * data from all the original snapshot block devices. At the same time, the
  * difference storage itself can contain regions on various block devices.
+ *
+ * Each block device has its own list of empty blocks. The parts of the
+ * storage are reserved on the block devices in turn, so the writing of the
+ * chunks is striped across all block devices of the difference storage.
+ *
+ * The regions are allocated from the part reserved for the current CPU
+ * without taking the lock. Only when the part is exhausted, a new one is
+ * reserved from the lists of empty blocks.
+ *
+ * Instead of the ranges of sectors, files can be appended to the difference
+ * storage. Their blocks are pinned like the blocks of a swap file until the
+ * difference storage is freed.
  */
 struct diff_storage {
 	struct kref kref;
 	spinlock_t lock;
 
 	struct list_head storage_bdevs;
-	struct list_head empty_blocks;
+	unsigned int storage_bdev_count;
+	struct storage_bdev *next_storage_bdev;
+	struct diff_storage_cursor __percpu *cursors;
 	struct list_head filled_blocks;
 
 	sector_t capacity;
 	sector_t filled;
 	sector_t requested;
+	sector_t wasted;
+	sector_t consumed;
+
+	unsigned long rate_stamp;
+	sector_t rate_consumed;
+	sector_t fill_rate;
 
 	atomic_t low_space_flag;
 	atomic_t overflow_flag;
 
-	struct event_queue event_queue;
+	struct event_queue *event_queue;
+
+	struct mutex file_lock;
+	struct list_head storage_files;
+
+	spinlock_t dedup_lock;
+	struct hlist_head *dedup_table;
 #ifdef BLK_SNAP_DEBUG_DIFF_STORAGE_LISTS
 	atomic_t free_block_count;
 	atomic_t user_block_count;
@@ -87,13 +193,29 @@ static inline void diff_storage_put(struct diff_storage *diff_storage)
 int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
 			      struct blk_snap_block_range __user *ranges,
 			      unsigned int range_count);
-struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
-					    sector_t count);
+int diff_storage_append_file(struct diff_storage *diff_storage,
+			     struct file *file, sector_t sector_count);
+int diff_storage_new_region(struct diff_storage *diff_storage, sector_t count,
+			    struct diff_region *diff_region);
+void diff_storage_get_stat(struct diff_storage *diff_storage,
+			   struct blk_snap_snapshot_storage_stat *stat);
+unsigned int diff_storage_get_usage(struct diff_storage *diff_storage,
+			struct blk_snap_snapshot_storage_usage *usage,
+			struct blk_snap_storage_dev_usage *dev_usage_array,
+			unsigned int count);
 
-static inline void diff_storage_free_region(struct diff_region *region)
+static inline bool diff_storage_dedup_enabled(struct diff_storage *diff_storage)
 {
-	kfree(region);
-	if (region)
-		memory_object_dec(memory_object_diff_region);
-}
+	return !!diff_storage->dedup_table;
+};
+struct diff_storage_dedup *diff_storage_dedup_new(u64 hash, size_t size,
+						  bool is_compressed);
+void diff_storage_dedup_free(struct diff_storage_dedup *dedup);
+bool diff_storage_dedup_lookup(struct diff_storage *diff_storage,
+			       struct diff_storage_dedup *dedup,
+			       struct diff_region *prev,
+			       struct diff_region *diff_region);
+void diff_storage_dedup_add(struct diff_storage *diff_storage,
+			    struct diff_storage_dedup *dedup,
+			    struct diff_region *diff_region);
 #endif /* __BLK_SNAP_DIFF_STORAGE_H */
@@ -2,31 +2,117 @@
 #define pr_fmt(fmt) KBUILD_MODNAME "-event_queue: " fmt
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/mempool.h>
 #include "memory_checker.h"
 #include "event_queue.h"
 #ifdef STANDALONE_BDEVFILTER
 #include "log.h"
 #endif
 
-void event_queue_init(struct event_queue *event_queue)
+/*
+ * The events generated on the I/O path carry only a few bytes of data.
+ * Such events are allocated from the mempool. Larger events are allocated
+ * by kzalloc().
+ */
+#define EVENT_SMALL_DATA_SIZE 64
+#define EVENT_POOL_SIZE 16
+
+static struct kmem_cache *event_cache;
+static mempool_t *event_pool;
+
+static inline bool event_is_small(int data_size)
+{
+	return data_size <= EVENT_SMALL_DATA_SIZE;
+}
+
+int event_init(void)
+{
+	event_cache = kmem_cache_create("blksnap_event",
+					sizeof(struct event) +
+						EVENT_SMALL_DATA_SIZE,
+					0, 0, NULL);
+	if (!event_cache)
+		return -ENOMEM;
+
+	event_pool = mempool_create_slab_pool(EVENT_POOL_SIZE, event_cache);
+	if (!event_pool) {
+		kmem_cache_destroy(event_cache);
+		event_cache = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void event_done(void)
 {
+	mempool_destroy(event_pool);
+	event_pool = NULL;
+	kmem_cache_destroy(event_cache);
+	event_cache = NULL;
+}
+
+void event_free(struct event *event)
+{
+	if (unlikely(!event))
+		return;
+
+	if (event_is_small(event->data_size))
+		mempool_free(event, event_pool);
+	else
+		kfree(event);
+	memory_object_dec(memory_object_event);
+}
+
+struct event_queue *event_queue_new(void)
+{
+	struct event_queue *event_queue;
+
+	event_queue = kzalloc(sizeof(struct event_queue), GFP_KERNEL);
+	if (!event_queue)
+		return NULL;
+	memory_object_inc(memory_object_event_queue);
+
+	kref_init(&event_queue->kref);
 	INIT_LIST_HEAD(&event_queue->list);
 	spin_lock_init(&event_queue->lock);
 	init_waitqueue_head(&event_queue->wq_head);
+
+	return event_queue;
 }
 
-void event_queue_done(struct event_queue *event_queue)
+void event_queue_free(struct kref *kref)
 {
+	struct event_queue *event_queue =
+		container_of(kref, struct event_queue, kref);
 	struct event *event;
 
-	spin_lock(&event_queue->lock);
 	while (!list_empty(&event_queue->list)) {
 		event = list_first_entry(&event_queue->list, struct event,
 					 link);
 		list_del(&event->link);
 		event_free(event);
 	}
+
+	kfree(event_queue);
+	memory_object_dec(memory_object_event_queue);
+}
+
+/**
+ * event_queue_close() - Marks the queue as closed.
+ * @event_queue:
+ *	The queue of events.
+ *
+ * Called when the owner of the queue is released. The waiting readers are
+ * woken up.
+ */
+void event_queue_close(struct event_queue *event_queue)
+{
+	spin_lock(&event_queue->lock);
+	event_queue->is_closed = true;
 	spin_unlock(&event_queue->lock);
+
+	wake_up_all(&event_queue->wq_head);
 }
 
 int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
@@ -34,7 +120,12 @@ int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
 {
 	struct event *event;
 
-	event = kzalloc(sizeof(struct event) + data_size, flags);
+	if (event_is_small(data_size)) {
+		event = mempool_alloc(event_pool, flags);
+		if (event)
+			memset(event, 0, sizeof(struct event) + data_size);
+	} else
+		event = kzalloc(sizeof(struct event) + data_size, flags);
 	if (!event)
 		return -ENOMEM;
 	memory_object_inc(memory_object_event);
@@ -55,28 +146,68 @@ int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
 	return 0;
 }
 
-struct event *event_wait(struct event_queue *event_queue,
-			 unsigned long timeout_ms)
+/**
+ * event_get() - Takes the first event from the queue without waiting.
+ * @event_queue:
+ *	The queue of events.
+ *
+ * Returns NULL if the queue is empty.
+ */
+struct event *event_get(struct event_queue *event_queue)
 {
-	int ret;
-
-	ret = wait_event_interruptible_timeout(event_queue->wq_head,
-					       !list_empty(&event_queue->list),
-					       timeout_ms);
-
-	if (ret > 0) {
-		struct event *event;
+	struct event *event;
 
-		spin_lock(&event_queue->lock);
-		event = list_first_entry(&event_queue->list, struct event,
+	spin_lock(&event_queue->lock);
+	event = list_first_entry_or_null(&event_queue->list, struct event,
 					 link);
+	if (event)
 		list_del(&event->link);
-		spin_unlock(&event_queue->lock);
+	spin_unlock(&event_queue->lock);
 
+	if (event)
 		pr_debug("Event received: time=%lld code=%d\n", event->time,
 			 event->code);
-		return event;
-	}
+	return event;
+}
+
+/*
+ * Returns the event that could not be passed to the user space back to the
+ * head of the queue.
+ */
+void event_requeue(struct event_queue *event_queue, struct event *event)
+{
+	spin_lock(&event_queue->lock);
+	list_add(&event->link, &event_queue->list);
+	spin_unlock(&event_queue->lock);
+
+	wake_up(&event_queue->wq_head);
+}
+
+struct event *event_wait(struct event_queue *event_queue,
+			 unsigned long timeout_ms)
+{
+	long ret;
+	unsigned long timeout = timeout_ms;
+
+	do {
+		struct event *event;
+
+		ret = wait_event_interruptible_timeout(event_queue->wq_head,
+				!event_queue_is_empty(event_queue), timeout);
+		if (ret <= 0)
+			break;
+
+		/*
+		 * The event could have been taken by the reader of the
+		 * file descriptor of the events. Then the waiting continues
+		 * for the rest of the timeout.
+		 */
+		event = event_get(event_queue);
+		if (event)
+			return event;
+		timeout = ret;
+	} while (true);
+
 	if (ret == 0)
 		return ERR_PTR(-ENOENT);
 
@@ -85,6 +216,6 @@ struct event *event_wait(struct event_queue *event_queue,
 		return ERR_PTR(-EINTR);
 	}
 
-	pr_err("Failed to wait event. errno=%d\n", abs(ret));
+	pr_err("Failed to wait event. errno=%ld\n", abs(ret));
 	return ERR_PTR(ret);
 }
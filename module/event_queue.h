@@ -3,6 +3,7 @@
 #define __BLK_SNAP_EVENT_QUEUE_H
 
 #include <linux/types.h>
+#include <linux/kref.h>
 #include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
@@ -35,6 +36,9 @@ struct event {
 
 /**
  * struct event_queue - A queue of &struct event.
+ * @kref:
+ *	The reference counter allows the file of the events to keep the queue
+ *	after the owner of the queue has been released.
  * @list:
  *	Linked list for storing events.
  * @lock:
@@ -42,24 +46,47 @@ struct event {
  * @wq_head:
  *	A wait queue allows to put a user thread in a waiting state until
  *	an event appears in the linked list.
+ * @is_closed:
+ *	No more events will be generated. The readers receive the events
+ *	that are left in the queue and then the end of the file.
  */
 struct event_queue {
+	struct kref kref;
 	struct list_head list;
 	spinlock_t lock;
 	struct wait_queue_head wq_head;
+	bool is_closed;
 };
 
-void event_queue_init(struct event_queue *event_queue);
-void event_queue_done(struct event_queue *event_queue);
+int event_init(void);
+void event_done(void);
+
+struct event_queue *event_queue_new(void);
+void event_queue_free(struct kref *kref);
+static inline void event_queue_get(struct event_queue *event_queue)
+{
+	kref_get(&event_queue->kref);
+};
+static inline void event_queue_put(struct event_queue *event_queue)
+{
+	if (likely(event_queue))
+		kref_put(&event_queue->kref, event_queue_free);
+};
+void event_queue_close(struct event_queue *event_queue);
+static inline bool event_queue_is_closed(struct event_queue *event_queue)
+{
+	return READ_ONCE(event_queue->is_closed);
+};
 
 int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
 	      const void *data, int data_size);
 struct event *event_wait(struct event_queue *event_queue,
 			 unsigned long timeout_ms);
-static inline void event_free(struct event *event)
+struct event *event_get(struct event_queue *event_queue);
+void event_requeue(struct event_queue *event_queue, struct event *event);
+static inline bool event_queue_is_empty(struct event_queue *event_queue)
 {
-	kfree(event);
-	if (event)
-		memory_object_dec(memory_object_event);
+	return list_empty_careful(&event_queue->list);
 };
+void event_free(struct event *event);
 #endif /* __BLK_SNAP_EVENT_QUEUE_H */
@@ -15,6 +15,8 @@
 #include "snapshot.h"
 #include "tracker.h"
 #include "diff_io.h"
+#include "diff_area.h"
+#include "diff_compress.h"
 #ifdef STANDALONE_BDEVFILTER
 #include "log.h"
 #endif
@@ -77,12 +79,36 @@ static int __init blk_snap_init(void)
 	pr_debug("chunk_maximum_in_cache: %d\n", chunk_maximum_in_cache);
 	pr_debug("free_diff_buffer_pool_size: %d\n",
 		 free_diff_buffer_pool_size);
+	pr_debug("cache_min_available_percent: %d\n",
+		 cache_min_available_percent);
 	pr_debug("diff_storage_minimum: %d\n", diff_storage_minimum);
+	pr_debug("image_worker_count: %d\n", image_worker_count);
+	pr_debug("image_readahead_limit: %d\n", image_readahead_limit);
+	pr_debug("cow_io_weight: %d\n", cow_io_weight);
+	pr_debug("image_io_weight: %d\n", image_io_weight);
+	pr_debug("image_io_max_wait: %d\n", image_io_max_wait);
+	pr_debug("diff_storage_horizon: %d\n", diff_storage_horizon);
+	pr_debug("chunk_compression: %d\n", chunk_compression);
+	pr_debug("chunk_deduplication: %d\n", chunk_deduplication);
+	pr_debug("chunk_ram_tier_high: %d\n", chunk_ram_tier_high);
+	pr_debug("chunk_ram_tier_low: %d\n", chunk_ram_tier_low);
 
 	result = diff_io_init();
 	if (result)
 		return result;
 
+	result = diff_compress_init();
+	if (result)
+		return result;
+
+	result = event_init();
+	if (result)
+		return result;
+
+	result = diff_area_init();
+	if (result)
+		return result;
+
 	result = snapimage_init();
 	if (result)
 		return result;
@@ -106,10 +132,13 @@ static void __exit blk_snap_exit(void)
 	sysfs_done();
 	ctrl_done();
 
-	diff_io_done();
 	snapshot_done();
 	snapimage_done();
 	tracker_done();
+	diff_area_done();
+	diff_compress_done();
+	event_done();
+	diff_io_done();
 
 #ifdef BLK_SNAP_FILELOG
 	log_done();
@@ -181,6 +210,14 @@ int chunk_maximum_in_cache = 32;
  */
 int free_diff_buffer_pool_size = 128;
 
+/*
+ * The percentage of available RAM above which the chunk cache and the pool
+ * of free difference buffers are allowed to grow beyond their limits.
+ * Such buffers are released by the shrinker when memory becomes scarce.
+ * The value 100 disables this behavior.
+ */
+int cache_min_available_percent = 25;
+
 /*
  * The minimum allowable size of the difference storage in sectors.
  * The difference storage is a part of the disk space allocated for storing
@@ -189,6 +226,73 @@ int free_diff_buffer_pool_size = 128;
  */
 int diff_storage_minimum = 2097152;
 
+/*
+ * The number of worker threads that process I/O requests to a snapshot
+ * image. The requests to different chunks are processed in parallel.
+ * The value is limited by the number of CPUs.
+ */
+int image_worker_count = 4;
+
+/*
+ * The maximum amount of memory in MiB that can be used to prefetch chunks
+ * when reading a snapshot image sequentially. Only the compressed chunks
+ * are prefetched, so the readahead works only when the chunk_compression
+ * is enabled. The value 0 disables the readahead.
+ */
+int image_readahead_limit = 64;
+
+/*
+ * The weights of the copy-on-write I/O of the original block device and of
+ * the I/O of the snapshot image. When both are in progress, the number of
+ * incomplete I/O operations of the snapshot image is limited by the ratio
+ * of these weights, so the original block device has priority.
+ */
+int cow_io_weight = 4;
+int image_io_weight = 1;
+
+/*
+ * The maximum time in milliseconds that an I/O request to the snapshot
+ * image waits for the copy-on-write I/O to complete.
+ */
+int image_io_max_wait = 100;
+
+/*
+ * The time in seconds for which the free space of the difference storage
+ * should be enough at the current fill rate. When less free space is left,
+ * an event is generated that requests the space for this time, but not
+ * less than diff_storage_minimum.
+ */
+int diff_storage_horizon = 10;
+
+/*
+ * Enables the compression of the chunks stored in the difference storage
+ * with the LZ4 algorithm. It reduces the amount of the difference storage
+ * I/O and space at the cost of CPU time. The chunks that do not compress
+ * well are stored as is.
+ */
+int chunk_compression;
+
+/*
+ * Enables the deduplication of the chunks stored in the difference storage.
+ * The chunks of all the devices of the snapshot with the same content share
+ * one region of the difference storage. The content is compared by the hash
+ * and then byte by byte, which requires reading the region back.
+ */
+int chunk_deduplication;
+
+/*
+ * The RAM tier of the difference storage. If the high watermark is set, the
+ * chunks copied from the original block device are kept in memory as the
+ * chunks of the write cache. When the number of such chunks of the block
+ * device exceeds the high watermark, they are stored in the difference
+ * storage in a batch until the number drops to the low watermark. Short
+ * snapshots may therefore never write to the difference storage at all.
+ * The memory consumption of the tier is limited by the high watermark
+ * multiplied by the size of the chunk for each block device.
+ */
+int chunk_ram_tier_high;
+int chunk_ram_tier_low;
+
 module_param_named(tracking_block_minimum_shift, tracking_block_minimum_shift,
 		   int, 0644);
 MODULE_PARM_DESC(tracking_block_minimum_shift,
@@ -210,9 +314,43 @@ module_param_named(free_diff_buffer_pool_size, free_diff_buffer_pool_size, int,
 		   0644);
 MODULE_PARM_DESC(free_diff_buffer_pool_size,
 		 "The size of the pool of preallocated difference buffers");
+module_param_named(cache_min_available_percent, cache_min_available_percent,
+		   int, 0644);
+MODULE_PARM_DESC(cache_min_available_percent,
+	"The percentage of available RAM that allows the chunk cache to grow");
 module_param_named(diff_storage_minimum, diff_storage_minimum, int, 0644);
 MODULE_PARM_DESC(diff_storage_minimum,
 	"The minimum allowable size of the difference storage in sectors");
+module_param_named(image_worker_count, image_worker_count, int, 0644);
+MODULE_PARM_DESC(image_worker_count,
+	"The number of worker threads for each snapshot image");
+module_param_named(image_readahead_limit, image_readahead_limit, int, 0644);
+MODULE_PARM_DESC(image_readahead_limit,
+	"The maximum amount of memory in MiB for the snapshot image readahead of compressed chunks");
+module_param_named(cow_io_weight, cow_io_weight, int, 0644);
+MODULE_PARM_DESC(cow_io_weight,
+	"The weight of the copy-on-write I/O of the original block device");
+module_param_named(image_io_weight, image_io_weight, int, 0644);
+MODULE_PARM_DESC(image_io_weight,
+	"The weight of the I/O of the snapshot image");
+module_param_named(image_io_max_wait, image_io_max_wait, int, 0644);
+MODULE_PARM_DESC(image_io_max_wait,
+	"The maximum time in milliseconds for the snapshot image I/O throttling");
+module_param_named(diff_storage_horizon, diff_storage_horizon, int, 0644);
+MODULE_PARM_DESC(diff_storage_horizon,
+	"The time in seconds for which the difference storage should be enough");
+module_param_named(chunk_compression, chunk_compression, int, 0444);
+MODULE_PARM_DESC(chunk_compression,
+	"Compress the chunks stored in the difference storage with LZ4");
+module_param_named(chunk_deduplication, chunk_deduplication, int, 0644);
+MODULE_PARM_DESC(chunk_deduplication,
+	"Share the regions of the difference storage between identical chunks");
+module_param_named(chunk_ram_tier_high, chunk_ram_tier_high, int, 0644);
+MODULE_PARM_DESC(chunk_ram_tier_high,
+	"The number of chunks kept in memory at which they start to be stored");
+module_param_named(chunk_ram_tier_low, chunk_ram_tier_low, int, 0644);
+MODULE_PARM_DESC(chunk_ram_tier_low,
+	"The number of chunks kept in memory at which they stop being stored");
 
 MODULE_DESCRIPTION("Block Layer Snapshot Kernel Module");
 MODULE_VERSION(VERSION_STR);
@@ -21,11 +21,16 @@ char *memory_object_names[] = {
 	"diff_storage",
 	"storage_bdev",
 	"storage_block",
-	"diff_region",
+	"storage_file",
 	"diff_buffer",
+	"compress_buffer",
+	"dedup_entry",
+	"dedup_table",
 	"event",
+	"event_queue",
 	"snapimage",
 	"snapshot",
+	"snapshot_event_ctx",
 	"tracker",
 	"tracked_device",
 	/*kcalloc*/
@@ -34,8 +39,10 @@ char *memory_object_names[] = {
 	"blk_snap_dev",
 	"tracker_array",
 	"snapimage_array",
+	"diff_area_array",
 	"superblock_array",
 	"blk_snap_image_info",
+	"blk_snap_usage",
 	"log_filepath",
 	/*end*/
 };
@@ -16,11 +16,16 @@ enum memory_object_type {
 	memory_object_diff_storage,
 	memory_object_storage_bdev,
 	memory_object_storage_block,
-	memory_object_diff_region,
+	memory_object_storage_file,
 	memory_object_diff_buffer,
+	memory_object_compress_buffer,
+	memory_object_dedup_entry,
+	memory_object_dedup_table,
 	memory_object_event,
+	memory_object_event_queue,
 	memory_object_snapimage,
 	memory_object_snapshot,
+	memory_object_snapshot_event_ctx,
 	memory_object_tracker,
 	memory_object_tracked_device,
 	/*kcalloc*/
@@ -29,8 +34,10 @@ enum memory_object_type {
 	memory_object_blk_snap_dev,
 	memory_object_tracker_array,
 	memory_object_snapimage_array,
+	memory_object_diff_area_array,
 	memory_object_superblock_array,
 	memory_object_blk_snap_image_info,
+	memory_object_blk_snap_usage,
 	memory_object_log_filepath,
 	/*end*/
 	memory_object_count
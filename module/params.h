@@ -8,5 +8,16 @@ extern int chunk_minimum_shift;
 extern int chunk_maximum_count;
 extern int chunk_maximum_in_cache;
 extern int free_diff_buffer_pool_size;
+extern int cache_min_available_percent;
+extern int image_worker_count;
+extern int image_readahead_limit;
+extern int cow_io_weight;
+extern int image_io_weight;
+extern int image_io_max_wait;
 extern int diff_storage_minimum;
+extern int diff_storage_horizon;
+extern int chunk_compression;
+extern int chunk_deduplication;
+extern int chunk_ram_tier_high;
+extern int chunk_ram_tier_low;
 #endif /* __BLK_SNAP_PARAMS_H */
@@ -9,31 +9,67 @@
 #include <linux/blk_snap.h>
 #endif
 #include "memory_checker.h"
+#include "params.h"
 #include "snapimage.h"
 #include "diff_area.h"
 #include "chunk.h"
 #include "cbt_map.h"
+#include "diff_compress.h"
 #ifdef STANDALONE_BDEVFILTER
 #include "log.h"
 #endif
 
 #define NR_SNAPIMAGE_DEVT	(1 << MINORBITS)
 
-struct snapimage_bio_prefix
-{
-	struct kthread_work work;
-	struct bio bio[0];
-};
-
 static unsigned int _major;
 static DEFINE_IDA(snapimage_devt_ida);
 
-struct bio_set snapimage_bioset;
+static void snapimage_process_bio(struct snapimage *snapimage, struct bio *bio)
+{
+	struct diff_area_image_ctx io_ctx;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	sector_t pos = bio->bi_iter.bi_sector;
+
+	diff_area_throttling_io(snapimage->diff_area);
+	diff_area_image_ctx_init(&io_ctx, snapimage->diff_area,
+				 op_is_write(bio_op(bio)));
+	if (op_is_write(bio_op(bio))) {
+		io_ctx.write_end = bio_end_sector(bio);
+		bio_for_each_segment(bvec, bio, iter) {
+			blk_status_t st;
+
+			st = diff_area_image_io(&io_ctx, &bvec, &pos);
+			if (unlikely(st != BLK_STS_OK)) {
+				bio->bi_status = st;
+				break;
+			}
+		}
+	} else {
+		blk_status_t st;
 
-static inline void snapimage_unprepare_worker(struct snapimage *snapimage)
+		st = diff_area_image_read(&io_ctx, bio);
+		if (unlikely(st != BLK_STS_OK))
+			bio->bi_status = st;
+	}
+	diff_area_image_ctx_done(&io_ctx);
+	bio_endio(bio);
+}
+
+static void snapimage_worker_fn(struct kthread_work *work)
 {
-	kthread_flush_worker(&snapimage->worker);
-	kthread_stop(snapimage->worker_task);
+	struct snapimage_worker *w =
+		container_of(work, struct snapimage_worker, work);
+	struct bio *bio;
+
+	do {
+		spin_lock(&w->lock);
+		bio = bio_list_pop(&w->bios);
+		spin_unlock(&w->lock);
+
+		if (bio)
+			snapimage_process_bio(w->snapimage, bio);
+	} while (bio);
 }
 
 static int snapimage_kthread_worker_fn(void *worker_ptr)
@@ -42,52 +78,150 @@ static int snapimage_kthread_worker_fn(void *worker_ptr)
 	return kthread_worker_fn(worker_ptr);
 }
 
-static inline int snapimage_prepare_worker(struct snapimage *snapimage)
+static inline void snapimage_unprepare_workers(struct snapimage *snapimage)
 {
-	struct task_struct *task;
+	unsigned int inx;
 
-	kthread_init_worker(&snapimage->worker);
+	if (!snapimage->workers)
+		return;
 
-	task = kthread_run(snapimage_kthread_worker_fn, &snapimage->worker,
-			   BLK_SNAP_IMAGE_NAME "%d",
-			   MINOR(snapimage->image_dev_id));
-	if (IS_ERR(task))
-		return -ENOMEM;
+	for (inx = 0; inx < snapimage->worker_count; inx++) {
+		struct snapimage_worker *w = &snapimage->workers[inx];
 
-	set_user_nice(task, MIN_NICE);
+		if (!w->task)
+			continue;
+
+		kthread_flush_worker(&w->worker);
+		kthread_stop(w->task);
+	}
+
+	kfree(snapimage->workers);
+	snapimage->workers = NULL;
+}
+
+static inline int snapimage_prepare_workers(struct snapimage *snapimage)
+{
+	unsigned int inx;
+	unsigned int count = clamp_t(int, image_worker_count, 1,
+				     num_possible_cpus());
+
+	snapimage->workers = kcalloc(count, sizeof(struct snapimage_worker),
+				     GFP_KERNEL);
+	if (!snapimage->workers)
+		return -ENOMEM;
+	snapimage->worker_count = count;
+
+	for (inx = 0; inx < count; inx++) {
+		struct snapimage_worker *w = &snapimage->workers[inx];
+		struct task_struct *task;
+
+		w->snapimage = snapimage;
+		spin_lock_init(&w->lock);
+		bio_list_init(&w->bios);
+		kthread_init_work(&w->work, snapimage_worker_fn);
+		kthread_init_worker(&w->worker);
+
+		task = kthread_run(snapimage_kthread_worker_fn, &w->worker,
+				   BLK_SNAP_IMAGE_NAME "%d/%u",
+				   MINOR(snapimage->image_dev_id), inx);
+		if (IS_ERR(task)) {
+			snapimage_unprepare_workers(snapimage);
+			return -ENOMEM;
+		}
+
+		set_user_nice(task, MIN_NICE);
+		w->task = task;
+	}
 
-	snapimage->worker_task = task;
 	return 0;
 }
 
-static void snapimage_process_bio(struct kthread_work *work)
+/*
+ * The bios that fall into the same chunk are processed by the same worker.
+ * This keeps the order of requests to one chunk and allows the bios of
+ * different chunks to be processed in parallel.
+ */
+static inline struct snapimage_worker *
+snapimage_select_worker(struct snapimage *snapimage, struct bio *bio)
 {
-	struct snapimage_bio_prefix *pfx =
-		container_of(work, struct snapimage_bio_prefix, work);
-	struct bio *bio = pfx->bio;
-#ifdef HAVE_BI_BDEV
-	struct snapimage *snapimage = bio->bi_bdev->bd_disk->private_data;
-#endif
-#ifdef HAVE_BI_BDISK
-	struct snapimage *snapimage = bio->bi_disk->private_data;
-#endif
-	struct diff_area_image_ctx io_ctx;
-	struct bio_vec bvec;
-	struct bvec_iter iter;
-	sector_t pos = bio->bi_iter.bi_sector;
+	struct diff_area *diff_area = snapimage->diff_area;
+	unsigned long number = (unsigned long)(bio->bi_iter.bi_sector >>
+				(diff_area->chunk_shift - SECTOR_SHIFT));
 
-	diff_area_throttling_io(snapimage->diff_area);
-	diff_area_image_ctx_init(&io_ctx, snapimage->diff_area,
-				 op_is_write(bio_op(bio)));
-	bio_for_each_segment(bvec, bio, iter) {
-		blk_status_t st;
+	return &snapimage->workers[number % snapimage->worker_count];
+}
 
-		st = diff_area_image_io(&io_ctx, &bvec, &pos);
-		if (unlikely(st != BLK_STS_OK))
-			break;
+static inline unsigned long
+snapimage_readahead_window_max(struct diff_area *diff_area)
+{
+	unsigned long window_max;
+
+	/*
+	 * Only the compressed chunks are prefetched. The other chunks are read
+	 * by redirecting the bio, so without the compression the readahead has
+	 * nothing to do.
+	 */
+	if (!diff_compress_enabled() || (image_readahead_limit <= 0))
+		return 0;
+
+	window_max = (unsigned long)(((u64)image_readahead_limit << 20) >>
+				     diff_area->chunk_shift);
+	/*
+	 * The prefetched chunks should not be pushed out of the cache before
+	 * they are read.
+	 */
+	return min_t(unsigned long, window_max, chunk_maximum_in_cache);
+}
+
+/*
+ * Detects the sequential reading of the image and starts prefetching the
+ * chunks ahead of the stream. The detection is performed when the bio is
+ * submitted, since the bios are processed by several workers out of order.
+ */
+static void snapimage_readahead(struct snapimage *snapimage, struct bio *bio)
+{
+	struct snapimage_readahead *ra = &snapimage->readahead;
+	struct diff_area *diff_area = snapimage->diff_area;
+	unsigned long window_max;
+	unsigned long last_chunk;
+	unsigned long first;
+	unsigned long last;
+
+	if (op_is_write(bio_op(bio)) || !bio->bi_iter.bi_size)
+		return;
+
+	window_max = snapimage_readahead_window_max(diff_area);
+	if (!window_max)
+		return;
+
+	last_chunk = (unsigned long)((bio_end_sector(bio) - 1) >>
+				     (diff_area->chunk_shift - SECTOR_SHIFT));
+
+	spin_lock(&ra->lock);
+	if (bio->bi_iter.bi_sector != ra->next_sector) {
+		ra->next_sector = bio_end_sector(bio);
+		ra->last_chunk = last_chunk;
+		ra->next_chunk = last_chunk + 1;
+		ra->window = 0;
+		spin_unlock(&ra->lock);
+		return;
 	}
-	diff_area_image_ctx_done(&io_ctx);
-	bio_endio(bio);
+	ra->next_sector = bio_end_sector(bio);
+	if (!ra->window || (last_chunk > ra->last_chunk))
+		ra->window = min_t(unsigned long, max_t(unsigned long,
+							ra->window * 2, 1),
+				   window_max);
+	ra->last_chunk = last_chunk;
+
+	first = max_t(unsigned long, ra->next_chunk, last_chunk + 1);
+	last = min_t(unsigned long, last_chunk + ra->window,
+		     diff_area->chunk_count - 1);
+	if (first <= last)
+		ra->next_chunk = last + 1;
+	spin_unlock(&ra->lock);
+
+	for (; first <= last; first++)
+		diff_area_prefetch_chunk(diff_area, first);
 }
 
 #ifdef HAVE_QC_SUBMIT_BIO
@@ -104,11 +238,15 @@ static void snapimage_submit_bio(struct bio *bio)
 #ifdef HAVE_BI_BDISK
 	struct snapimage *snapimage = bio->bi_disk->private_data;
 #endif
-	struct snapimage_bio_prefix *pfx =
-		container_of(bio, struct snapimage_bio_prefix, bio[0]);
+	struct snapimage_worker *w = snapimage_select_worker(snapimage, bio);
 
-	kthread_init_work(&pfx->work, snapimage_process_bio);
-	kthread_queue_work(&snapimage->worker, &pfx->work);
+	snapimage_readahead(snapimage, bio);
+
+	spin_lock(&w->lock);
+	bio_list_add(&w->bios, bio);
+	spin_unlock(&w->lock);
+
+	kthread_queue_work(&w->worker, &w->work);
 
 #ifdef HAVE_QC_SUBMIT_BIO
 	return ret;
@@ -131,7 +269,7 @@ void snapimage_free(struct snapimage *snapimage)
 	snapimage->is_ready = false;
 	blk_mq_unfreeze_queue(snapimage->disk->queue);
 
-	snapimage_unprepare_worker(snapimage);
+	snapimage_unprepare_workers(snapimage);
 
 	del_gendisk(snapimage->disk);
 #ifdef HAVE_BLK_ALLOC_DISK
@@ -173,6 +311,26 @@ static inline struct gendisk *blk_alloc_disk(int node)
 }
 #endif
 
+/*
+ * The snapshot image inherits the block sizes of the original block device.
+ * The optimal I/O size is equal to the chunk size, so that the upper layers,
+ * such as the page cache readahead, send requests of whole chunks.
+ */
+static void snapimage_set_queue_limits(struct request_queue *q,
+				       struct diff_area *diff_area)
+{
+	struct block_device *orig_bdev = diff_area->orig_bdev;
+	unsigned int chunk_sectors = diff_area_chunk_sectors(diff_area);
+
+	blk_queue_logical_block_size(q, bdev_logical_block_size(orig_bdev));
+	blk_queue_physical_block_size(q, bdev_physical_block_size(orig_bdev));
+	blk_queue_io_min(q, bdev_io_min(orig_bdev));
+	blk_queue_io_opt(q, chunk_sectors << SECTOR_SHIFT);
+	blk_queue_chunk_sectors(q, chunk_sectors);
+	blk_queue_max_hw_sectors(q, max_t(unsigned int, BLK_DEF_MAX_SECTORS,
+					  chunk_sectors));
+}
+
 struct snapimage *snapimage_create(struct diff_area *diff_area,
 				   struct cbt_map *cbt_map)
 {
@@ -196,6 +354,7 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	}
 
 	snapimage->is_ready = true;
+	spin_lock_init(&snapimage->readahead.lock);
 	snapimage->capacity = cbt_map->device_capacity;
 	snapimage->image_dev_id = MKDEV(_major, minor);
 	pr_info("Create snapshot image device [%u:%u] for original device [%u:%u]\n",
@@ -204,9 +363,9 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 		MAJOR(diff_area->orig_bdev->bd_dev),
 		MINOR(diff_area->orig_bdev->bd_dev));
 
-	ret = snapimage_prepare_worker(snapimage);
+	ret = snapimage_prepare_workers(snapimage);
 	if (ret) {
-		pr_err("Failed to prepare worker thread. errno=%d\n", abs(ret));
+		pr_err("Failed to prepare worker threads. errno=%d\n", abs(ret));
 		goto fail_free_minor;
 	}
 
@@ -218,8 +377,7 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	}
 	snapimage->disk = disk;
 
-	blk_queue_max_hw_sectors(disk->queue, BLK_DEF_MAX_SECTORS);
-	blk_queue_flag_set(QUEUE_FLAG_NOMERGES, disk->queue);
+	snapimage_set_queue_limits(disk->queue, diff_area);
 
 	if (snprintf(disk->disk_name, DISK_NAME_LEN, "%s%d",
 		     BLK_SNAP_IMAGE_NAME, minor) < 0) {
@@ -275,7 +433,7 @@ fail_cleanup_disk:
 	del_gendisk(disk);
 #endif
 fail_free_worker:
-	snapimage_unprepare_worker(snapimage);
+	snapimage_unprepare_workers(snapimage);
 fail_free_minor:
 	ida_free(&snapimage_devt_ida, minor);
 fail_free_image:
@@ -298,21 +456,11 @@ int snapimage_init(void)
 	pr_info("Snapshot image block device major %d was registered\n",
 		_major);
 
-	ret = bioset_init(&snapimage_bioset, 64,
-			  sizeof(struct snapimage_bio_prefix),
-			  BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
-	if (ret) {
-		pr_err("Failed to initialize bioset\n");
-		unregister_blkdev(_major, BLK_SNAP_IMAGE_NAME);
-	}
-
-	return ret;
+	return 0;
 }
 
 void snapimage_done(void)
 {
-	bioset_exit(&snapimage_bioset);
-
 	unregister_blkdev(_major, BLK_SNAP_IMAGE_NAME);
 	pr_info("Snapshot image block device [%d] was unregistered\n", _major);
 }
@@ -12,6 +12,56 @@
 
 struct diff_area;
 struct cbt_map;
+struct snapimage;
+
+/**
+ * struct snapimage_worker - The worker thread of the snapshot image.
+ *
+ * @worker:
+ *	The kthread worker.
+ * @task:
+ *	A pointer to the &struct task of the worker thread.
+ * @work:
+ *	The work that processes the queue of bios.
+ * @lock:
+ *	Spinlock allows to guarantee safety of the bio list.
+ * @bios:
+ *	The queue of bios to be processed.
+ * @snapimage:
+ *	A pointer to the owner &struct snapimage.
+ */
+struct snapimage_worker {
+	struct kthread_worker worker;
+	struct task_struct *task;
+	struct kthread_work work;
+	spinlock_t lock;
+	struct bio_list bios;
+	struct snapimage *snapimage;
+};
+
+/**
+ * struct snapimage_readahead - The state of the sequential stream detection.
+ *
+ * @lock:
+ *	Spinlock allows to guarantee consistency of the state.
+ * @next_sector:
+ *	The sector expected at the beginning of the next sequential bio.
+ * @last_chunk:
+ *	The number of the chunk in which the previous bio ended.
+ * @next_chunk:
+ *	The number of the first chunk that has not yet been prefetched.
+ * @window:
+ *	The number of chunks to prefetch ahead of the stream. The window
+ *	doubles each time the sequential stream enters a new chunk and is
+ *	reset when the sequence is broken.
+ */
+struct snapimage_readahead {
+	spinlock_t lock;
+	sector_t next_sector;
+	unsigned long last_chunk;
+	unsigned long next_chunk;
+	unsigned long window;
+};
 
 /**
  * struct snapimage - Snapshot image block device.
@@ -24,10 +74,12 @@ struct cbt_map;
  * @is_ready:
  *	The flag means that the snapshot image is ready for processing
  *	I/O requests.
- * @worker:
- *	The worker thread for processing I/O requests.
- * @worker_task:
- *	A pointer to the &struct task of the worker thread.
+ * @workers:
+ *	An array of worker threads for processing I/O requests.
+ * @worker_count:
+ *	The number of worker threads.
+ * @readahead:
+ *	The state of the readahead for sequential reading of the image.
  * @disk:
  *	A pointer to the &struct gendisk for the image block device.
  * @diff_area:
@@ -39,6 +91,9 @@ struct cbt_map;
  * when reading or writing a snapshot image, the data is redirected to
  * the original block device or to the block device of the difference storage.
  *
+ * The I/O requests are processed by several worker threads in parallel.
+ * The requests to the same chunk are processed by the same worker.
+ *
  * The module does not prohibit reading and writing data to the snapshot
  * from different threads in parallel. To avoid the problem with simultaneous
  * access, it is enough to open the snapshot image block device with the
@@ -49,8 +104,9 @@ struct snapimage {
 	sector_t capacity;
 	bool is_ready;
 
-	struct kthread_worker worker;
-	struct task_struct *worker_task;
+	struct snapimage_worker *workers;
+	unsigned int worker_count;
+	struct snapimage_readahead readahead;
 
 	struct gendisk *disk;
 
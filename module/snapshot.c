@@ -2,6 +2,8 @@
 #define pr_fmt(fmt) KBUILD_MODNAME "-snapshot: " fmt
 #include <linux/slab.h>
 #include <linux/sched/mm.h>
+#include <linux/anon_inodes.h>
+#include <linux/poll.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blk_snap.h"
 #else
@@ -51,15 +53,16 @@ static void snapshot_release(struct snapshot *snapshot)
 #endif
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 
-		if (!tracker || !tracker->diff_area)
+		if (!tracker || !diff_area)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_freeze_bdev(tracker->diff_area->orig_bdev,
+		_freeze_bdev(diff_area->orig_bdev,
 			     &snapshot->superblock_array[inx]);
 #else
-		if (freeze_bdev(tracker->diff_area->orig_bdev))
+		if (freeze_bdev(diff_area->orig_bdev))
 			pr_err("Failed to freeze device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -77,7 +80,8 @@ static void snapshot_release(struct snapshot *snapshot)
 		 __FUNCTION__);
 #endif
 	for (inx = 0; inx < snapshot->count; ++inx)
-		tracker_release_snapshot(snapshot->tracker_array[inx]);
+		tracker_release_snapshot(snapshot->tracker_array[inx],
+					 snapshot->diff_area_array[inx]);
 
 	tracker_unlock();
 	memalloc_noio_restore(current_flag);
@@ -89,15 +93,16 @@ static void snapshot_release(struct snapshot *snapshot)
 #endif
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 
-		if (!tracker || !tracker->diff_area)
+		if (!tracker || !diff_area)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_thaw_bdev(tracker->diff_area->orig_bdev,
+		_thaw_bdev(diff_area->orig_bdev,
 			   snapshot->superblock_array[inx]);
 #else
-		if (thaw_bdev(tracker->diff_area->orig_bdev))
+		if (thaw_bdev(diff_area->orig_bdev))
 			pr_err("Failed to thaw device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -114,10 +119,10 @@ static void snapshot_release(struct snapshot *snapshot)
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
 
-		if (tracker) {
-			diff_area_put(tracker->diff_area);
-			tracker->diff_area = NULL;
+		diff_area_put(snapshot->diff_area_array[inx]);
+		snapshot->diff_area_array[inx] = NULL;
 
+		if (tracker) {
 			tracker_put(tracker);
 			snapshot->tracker_array[inx] = NULL;
 		}
@@ -136,6 +141,9 @@ static void snapshot_free(struct kref *kref)
 	kfree(snapshot->snapimage_array);
 	if (snapshot->snapimage_array)
 		memory_object_dec(memory_object_snapimage_array);
+	kfree(snapshot->diff_area_array);
+	if (snapshot->diff_area_array)
+		memory_object_dec(memory_object_diff_area_array);
 	kfree(snapshot->tracker_array);
 	if (snapshot->tracker_array)
 		memory_object_dec(memory_object_tracker_array);
@@ -152,6 +160,11 @@ static void snapshot_free(struct kref *kref)
 #ifdef BLK_SNAP_DEBUG_RELEASE_SNAPSHOT
 	pr_debug("DEBUG! %s put diff storage\n", __FUNCTION__);
 #endif
+	/*
+	 * The readers of the file of the events receive the end of the file.
+	 */
+	if (snapshot->diff_storage)
+		event_queue_close(snapshot->diff_storage->event_queue);
 	diff_storage_put(snapshot->diff_storage);
 
 	kfree(snapshot);
@@ -187,10 +200,17 @@ static struct snapshot *snapshot_new(unsigned int count)
 	}
 	memory_object_inc(memory_object_tracker_array);
 
+	snapshot->diff_area_array = kcalloc(count, sizeof(void *), GFP_KERNEL);
+	if (!snapshot->diff_area_array) {
+		ret = -ENOMEM;
+		goto fail_free_trackers;
+	}
+	memory_object_inc(memory_object_diff_area_array);
+
 	snapshot->snapimage_array = kcalloc(count, sizeof(void *), GFP_KERNEL);
 	if (!snapshot->snapimage_array) {
 		ret = -ENOMEM;
-		goto fail_free_trackers;
+		goto fail_free_diff_areas;
 	}
 	memory_object_inc(memory_object_snapimage_array);
 
@@ -225,6 +245,11 @@ fail_free_snapimage:
 	if (snapshot->snapimage_array)
 		memory_object_dec(memory_object_snapimage_array);
 
+fail_free_diff_areas:
+	kfree(snapshot->diff_area_array);
+	if (snapshot->diff_area_array)
+		memory_object_dec(memory_object_diff_area_array);
+
 fail_free_trackers:
 	kfree(snapshot->tracker_array);
 	if (snapshot->tracker_array)
@@ -414,6 +439,181 @@ int snapshot_append_storage(uuid_t *id, struct blk_snap_dev dev_id,
 	return ret;
 }
 
+/*
+ * The file is filled in with zeros when it is appended. If the file system of
+ * the file is on a device of a taken snapshot, each of these writes would be
+ * copied to the difference storage, that is being appended. So such a file
+ * is refused.
+ */
+static int snapshot_check_file(struct file *file)
+{
+	struct block_device *bdev = file_inode(file)->i_sb->s_bdev;
+	struct tracker *tracker;
+	int ret = 0;
+
+	if (!bdev)
+		return 0;
+
+	tracker = tracker_get_by_dev(bdev);
+	if (IS_ERR(tracker))
+		return PTR_ERR(tracker);
+	if (tracker && atomic_read(&tracker->snapshot_is_taken)) {
+		pr_err("Cannot append a file located on the device [%u:%u] of a taken snapshot\n",
+		       MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev));
+		ret = -EBUSY;
+	}
+	tracker_put(tracker);
+	return ret;
+}
+
+int snapshot_append_file(uuid_t *id, struct file *file, sector_t sector_count)
+{
+	int ret = 0;
+	struct snapshot *snapshot;
+
+	ret = snapshot_check_file(file);
+	if (ret)
+		return ret;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	ret = diff_storage_append_file(snapshot->diff_storage, file,
+				       sector_count);
+	snapshot_put(snapshot);
+	return ret;
+}
+
+int snapshot_get_storage_stat(uuid_t *id,
+			      struct blk_snap_snapshot_storage_stat *stat)
+{
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	diff_storage_get_stat(snapshot->diff_storage, stat);
+	snapshot_put(snapshot);
+	return 0;
+}
+
+static int snapshot_get_storage_dev_usage(struct snapshot *snapshot,
+			struct blk_snap_snapshot_storage_usage *usage)
+{
+	int ret = 0;
+	unsigned int count;
+	struct blk_snap_storage_dev_usage *dev_usage_array;
+
+	count = diff_storage_get_usage(snapshot->diff_storage, usage, NULL, 0);
+	if (!usage->storage_dev_array || !count)
+		goto out;
+
+	if (usage->storage_dev_count < count) {
+		ret = -ENODATA;
+		goto out;
+	}
+
+	dev_usage_array = kcalloc(count,
+				  sizeof(struct blk_snap_storage_dev_usage),
+				  GFP_KERNEL);
+	if (!dev_usage_array)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_usage);
+
+	/* The block devices can be appended in the meantime. */
+	if (diff_storage_get_usage(snapshot->diff_storage, usage,
+				   dev_usage_array, count) > count)
+		ret = -ENODATA;
+	else if (copy_to_user(usage->storage_dev_array, dev_usage_array,
+			      count * sizeof(struct blk_snap_storage_dev_usage))) {
+		pr_err("Unable to get difference storage usage: failed to copy data to user buffer\n");
+		ret = -ENODATA;
+	}
+
+	kfree(dev_usage_array);
+	memory_object_dec(memory_object_blk_snap_usage);
+out:
+	usage->storage_dev_count = count;
+	return ret;
+}
+
+static int snapshot_get_orig_dev_usage(struct snapshot *snapshot,
+			struct blk_snap_snapshot_storage_usage *usage)
+{
+	int ret = 0;
+	int inx;
+	struct blk_snap_orig_dev_usage *dev_usage_array = NULL;
+
+	if (usage->orig_dev_array) {
+		if (usage->orig_dev_count < snapshot->count)
+			ret = -ENODATA;
+		else {
+			dev_usage_array = kcalloc(snapshot->count,
+				sizeof(struct blk_snap_orig_dev_usage),
+				GFP_KERNEL);
+			if (!dev_usage_array)
+				return -ENOMEM;
+			memory_object_inc(memory_object_blk_snap_usage);
+		}
+	}
+
+	usage->region_count = 0;
+	for (inx = 0; inx < snapshot->count; inx++) {
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
+		u64 stored = 0;
+		u64 region_count = 0;
+
+		if (diff_area) {
+			stored = atomic64_read(&diff_area->stored_sectors);
+			region_count = atomic64_read(&diff_area->region_count);
+		}
+		usage->region_count += region_count;
+
+		if (dev_usage_array && snapshot->tracker_array[inx]) {
+			dev_t dev_id = snapshot->tracker_array[inx]->dev_id;
+
+			dev_usage_array[inx].dev_id.mj = MAJOR(dev_id);
+			dev_usage_array[inx].dev_id.mn = MINOR(dev_id);
+			dev_usage_array[inx].stored = stored;
+			dev_usage_array[inx].region_count = region_count;
+		}
+	}
+
+	if (dev_usage_array) {
+		if (copy_to_user(usage->orig_dev_array, dev_usage_array,
+				 snapshot->count *
+					 sizeof(struct blk_snap_orig_dev_usage))) {
+			pr_err("Unable to get difference storage usage: failed to copy data to user buffer\n");
+			ret = -ENODATA;
+		}
+		kfree(dev_usage_array);
+		memory_object_dec(memory_object_blk_snap_usage);
+	}
+
+	usage->orig_dev_count = snapshot->count;
+	return ret;
+}
+
+int snapshot_get_storage_usage(uuid_t *id,
+			       struct blk_snap_snapshot_storage_usage *usage)
+{
+	int ret;
+	int orig_ret;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	ret = snapshot_get_storage_dev_usage(snapshot, usage);
+	orig_ret = snapshot_get_orig_dev_usage(snapshot, usage);
+	snapshot_put(snapshot);
+
+	return ret ? ret : orig_ret;
+}
+
 int snapshot_take(uuid_t *id)
 {
 	int ret = 0;
@@ -449,7 +649,7 @@ int snapshot_take(uuid_t *id)
 			ret = PTR_ERR(diff_area);
 			goto fail;
 		}
-		tracker->diff_area = diff_area;
+		snapshot->diff_area_array[inx] = diff_area;
 	}
 
 	/* Try to flush and freeze file system on each original block device. */
@@ -465,10 +665,10 @@ int snapshot_take(uuid_t *id)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_freeze_bdev(tracker->diff_area->orig_bdev,
+		_freeze_bdev(snapshot->diff_area_array[inx]->orig_bdev,
 			     &snapshot->superblock_array[inx]);
 #else
-		if (freeze_bdev(tracker->diff_area->orig_bdev))
+		if (freeze_bdev(snapshot->diff_area_array[inx]->orig_bdev))
 			pr_err("Failed to freeze device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -493,7 +693,8 @@ int snapshot_take(uuid_t *id)
 	for (inx = 0; inx < snapshot->count; inx++) {
 		if (!snapshot->tracker_array[inx])
 			continue;
-		ret = tracker_take_snapshot(snapshot->tracker_array[inx]);
+		ret = tracker_take_snapshot(snapshot->tracker_array[inx],
+					    snapshot->diff_area_array[inx]);
 		if (ret) {
 			pr_err("Unable to take snapshot: failed to capture snapshot %pUb\n",
 			       &snapshot->id);
@@ -510,7 +711,8 @@ int snapshot_take(uuid_t *id)
 			struct tracker *tracker = snapshot->tracker_array[inx];
 
 			if (tracker)
-				tracker_release_snapshot(tracker);
+				tracker_release_snapshot(tracker,
+					snapshot->diff_area_array[inx]);
 		}
 	} else
 		snapshot->is_taken = true;
@@ -530,10 +732,10 @@ int snapshot_take(uuid_t *id)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_thaw_bdev(tracker->diff_area->orig_bdev,
+		_thaw_bdev(snapshot->diff_area_array[inx]->orig_bdev,
 			   snapshot->superblock_array[inx]);
 #else
-		if (thaw_bdev(tracker->diff_area->orig_bdev))
+		if (thaw_bdev(snapshot->diff_area_array[inx]->orig_bdev))
 			pr_err("Failed to thaw device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -557,7 +759,7 @@ int snapshot_take(uuid_t *id)
 		if (!tracker)
 			continue;
 
-		if (diff_area_is_corrupted(tracker->diff_area)) {
+		if (diff_area_is_corrupted(snapshot->diff_area_array[inx])) {
 			pr_err("Unable to freeze devices [%u:%u]: diff area is corrupted\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 			ret = -EFAULT;
@@ -574,8 +776,8 @@ int snapshot_take(uuid_t *id)
 		struct snapimage *snapimage;
 		struct tracker *tracker = snapshot->tracker_array[inx];
 
-		snapimage =
-			snapimage_create(tracker->diff_area, tracker->cbt_map);
+		snapimage = snapimage_create(snapshot->diff_area_array[inx],
+					     tracker->cbt_map);
 		if (IS_ERR(snapimage)) {
 			ret = PTR_ERR(snapimage);
 			pr_err("Failed to create snapshot image for device [%u:%u] with error=%d\n",
@@ -609,12 +811,167 @@ struct event *snapshot_wait_event(uuid_t *id, unsigned long timeout_ms)
 	if (!snapshot)
 		return ERR_PTR(-ESRCH);
 
-	event = event_wait(&snapshot->diff_storage->event_queue, timeout_ms);
+	event = event_wait(snapshot->diff_storage->event_queue, timeout_ms);
 
 	snapshot_put(snapshot);
 	return event;
 }
 
+/**
+ * struct snapshot_event_ctx - The context of the file of the snapshot
+ *	events.
+ * @id:
+ *	Snapshot ID. It is passed to the user space with each event.
+ * @event_queue:
+ *	The queue of events of the difference storage. The file holds a
+ *	reference to the queue only, so the difference storage is released
+ *	when the snapshot is destroyed. The queue is closed at that time.
+ */
+struct snapshot_event_ctx {
+	uuid_t id;
+	struct event_queue *event_queue;
+};
+
+static ssize_t snapshot_event_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	int ret;
+	ssize_t offset = 0;
+	struct snapshot_event_ctx *ctx = file->private_data;
+	struct event_queue *event_queue = ctx->event_queue;
+	struct blk_snap_snapshot_event *karg;
+	struct event *event;
+
+	if (count < sizeof(struct blk_snap_snapshot_event))
+		return -EINVAL;
+
+	karg = kzalloc(sizeof(struct blk_snap_snapshot_event), GFP_KERNEL);
+	if (!karg)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_snapshot_event);
+
+	export_uuid(karg->id.b, &ctx->id);
+	while ((offset + sizeof(struct blk_snap_snapshot_event)) <= count) {
+		event = event_get(event_queue);
+		if (!event) {
+			/*
+			 * The events that have already been received are
+			 * returned without waiting for the next ones. When
+			 * the snapshot is destroyed, the end of the file is
+			 * reached.
+			 */
+			if (offset || event_queue_is_closed(event_queue))
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				offset = -EAGAIN;
+				break;
+			}
+			ret = wait_event_interruptible(event_queue->wq_head,
+				!event_queue_is_empty(event_queue) ||
+				event_queue_is_closed(event_queue));
+			if (ret) {
+				offset = ret;
+				break;
+			}
+			continue;
+		}
+
+		karg->code = event->code;
+		karg->time_label = event->time;
+		memset(karg->data, 0, sizeof(karg->data));
+		if (event->data_size > sizeof(karg->data))
+			pr_err("Event size %d is too big\n", event->data_size);
+		memcpy(karg->data, event->data,
+		       min_t(size_t, event->data_size, sizeof(karg->data)));
+
+		if (copy_to_user(buf + offset, karg,
+				 sizeof(struct blk_snap_snapshot_event))) {
+			event_requeue(event_queue, event);
+			if (!offset)
+				offset = -EFAULT;
+			break;
+		}
+		event_free(event);
+		offset += sizeof(struct blk_snap_snapshot_event);
+	}
+
+	kfree(karg);
+	memory_object_dec(memory_object_blk_snap_snapshot_event);
+	return offset;
+}
+
+static __poll_t snapshot_event_poll(struct file *file, poll_table *wait)
+{
+	struct snapshot_event_ctx *ctx = file->private_data;
+	struct event_queue *event_queue = ctx->event_queue;
+	__poll_t mask = 0;
+
+	poll_wait(file, &event_queue->wq_head, wait);
+
+	if (!event_queue_is_empty(event_queue))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (event_queue_is_closed(event_queue))
+		mask |= EPOLLHUP;
+	return mask;
+}
+
+static int snapshot_event_release(struct inode *inode, struct file *file)
+{
+	struct snapshot_event_ctx *ctx = file->private_data;
+
+	event_queue_put(ctx->event_queue);
+	kfree(ctx);
+	memory_object_dec(memory_object_snapshot_event_ctx);
+	return 0;
+}
+
+static const struct file_operations snapshot_event_fops = {
+	.owner = THIS_MODULE,
+	.read = snapshot_event_read,
+	.poll = snapshot_event_poll,
+	.release = snapshot_event_release,
+	.llseek = noop_llseek,
+};
+
+/**
+ * snapshot_event_file() - Creates a file for receiving the events of the
+ *	snapshot.
+ * @id:
+ *	Snapshot ID.
+ */
+struct file *snapshot_event_file(uuid_t *id)
+{
+	struct snapshot *snapshot;
+	struct snapshot_event_ctx *ctx;
+	struct file *file;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return ERR_PTR(-ESRCH);
+
+	ctx = kzalloc(sizeof(struct snapshot_event_ctx), GFP_KERNEL);
+	if (!ctx) {
+		file = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	memory_object_inc(memory_object_snapshot_event_ctx);
+
+	uuid_copy(&ctx->id, id);
+	event_queue_get(snapshot->diff_storage->event_queue);
+	ctx->event_queue = snapshot->diff_storage->event_queue;
+
+	file = anon_inode_getfile("[blksnap-event]", &snapshot_event_fops, ctx,
+				  O_RDONLY);
+	if (IS_ERR(file)) {
+		event_queue_put(ctx->event_queue);
+		kfree(ctx);
+		memory_object_dec(memory_object_snapshot_event_ctx);
+	}
+out:
+	snapshot_put(snapshot);
+	return file;
+}
+
 int snapshot_collect(unsigned int *pcount, struct blk_snap_uuid __user *id_array)
 {
 	int ret = 0;
@@ -13,6 +13,7 @@
 #include "event_queue.h"
 
 struct tracker;
+struct diff_area;
 struct diff_storage;
 struct snapimage;
 /**
@@ -30,19 +31,22 @@ struct snapimage;
  *	A pointer to the difference storage of this snapshot.
  * @count:
  *	The number of block devices in the snapshot. This number
- *	corresponds to the size of arrays of pointers to trackers
- *	and snapshot images.
+ *	corresponds to the size of arrays of pointers to trackers,
+ *	difference areas and snapshot images.
  * @tracker_array:
  *	Array of pointers to block device trackers.
+ * @diff_area_array:
+ *	Array of pointers to difference areas of block devices. They are
+ *	allocated when the snapshot is taken.
  * @snapimage_array:
  *	Array of pointers to images of snapshots of block devices.
  *
  * A snapshot corresponds to a single backup session and provides snapshot
  * images for multiple block devices. Several backup sessions can be
  * performed at the same time, which means that several snapshots can
- * exist at the same time. However, the original block device can only
- * belong to one snapshot. Creating multiple snapshots from the same block
- * device is not allowed.
+ * exist at the same time. The original block device can belong to several
+ * snapshots. In this case, the copy-on-write data is read from the original
+ * block device once and is shared between the snapshots.
  *
  * A UUID is used to identify the snapshot.
  *
@@ -55,6 +59,7 @@ struct snapshot {
 	struct diff_storage *diff_storage;
 	int count;
 	struct tracker **tracker_array;
+	struct diff_area **diff_area_array;
 	struct snapimage **snapimage_array;
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
 	struct super_block **superblock_array;
@@ -69,6 +74,12 @@ int snapshot_destroy(uuid_t *id);
 int snapshot_append_storage(uuid_t *id, struct blk_snap_dev dev_id,
 			    struct blk_snap_block_range __user *ranges,
 			    unsigned int range_count);
+int snapshot_append_file(uuid_t *id, struct file *file, sector_t sector_count);
+int snapshot_get_storage_stat(uuid_t *id,
+			      struct blk_snap_snapshot_storage_stat *stat);
+int snapshot_get_storage_usage(uuid_t *id,
+			       struct blk_snap_snapshot_storage_usage *usage);
+struct file *snapshot_event_file(uuid_t *id);
 int snapshot_take(uuid_t *id);
 struct event *snapshot_wait_event(uuid_t *id, unsigned long timeout_ms);
 int snapshot_collect(unsigned int *pcount, struct blk_snap_uuid __user *id_array);
@@ -59,7 +59,7 @@ static void tracker_free(struct tracker *tracker)
 	pr_debug("Free tracker for device [%u:%u].\n", MAJOR(tracker->dev_id),
 		 MINOR(tracker->dev_id));
 
-	diff_area_put(tracker->diff_area);
+	WARN_ON(!list_empty(&tracker->diff_areas));
 	cbt_map_put(tracker->cbt_map);
 
 	kfree(tracker);
@@ -84,6 +84,60 @@ struct tracker *tracker_get_by_dev(struct block_device *bdev)
 void diff_io_endio(struct bio *bio);
 #endif
 
+/*
+ * The newest snapshot is processed first, so the chunks of the older
+ * snapshots can share the data being loaded for it. If the copy-on-write
+ * has failed for one of the snapshots, this snapshot is corrupted, but the
+ * other snapshots are still processed.
+ */
+static int tracker_copy(struct tracker *tracker, sector_t sector,
+			sector_t count, const bool is_nowait)
+{
+	struct diff_area *diff_area;
+	struct diff_area *leader;
+
+	leader = list_first_entry_or_null(&tracker->diff_areas,
+					  struct diff_area, tracker_link);
+	list_for_each_entry(diff_area, &tracker->diff_areas, tracker_link) {
+		int err;
+
+		if (diff_area_is_corrupted(diff_area))
+			continue;
+
+		err = diff_area_copy(diff_area, leader, sector, count,
+				     is_nowait);
+		if (err == -EAGAIN)
+			return err;
+		if (err)
+			pr_err("Failed to copy data to diff storage with error %d\n",
+			       abs(err));
+	}
+
+	return 0;
+}
+
+static int tracker_wait(struct tracker *tracker, sector_t sector,
+			sector_t count, const bool is_nowait)
+{
+	int ret = 0;
+	struct diff_area *diff_area;
+
+	list_for_each_entry(diff_area, &tracker->diff_areas, tracker_link) {
+		int err;
+
+		if (diff_area_is_corrupted(diff_area))
+			continue;
+
+		err = diff_area_wait(diff_area, sector, count, is_nowait);
+		if (err == -EAGAIN)
+			return err;
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
+
 static bool tracker_submit_bio_cb(struct bio *bio,
 		struct bdev_filter *flt)
 {
@@ -135,24 +189,23 @@ static bool tracker_submit_bio_cb(struct bio *bio,
 	if (!atomic_read(&tracker->snapshot_is_taken))
 		goto out;
 
-	if (diff_area_is_corrupted(tracker->diff_area))
-		goto out;
-
 	current_flag = memalloc_noio_save();
 	bio_list_init(&bio_list_on_stack[0]);
 	current->bio_list = bio_list_on_stack;
 	barrier();
 
-	err = diff_area_copy(tracker->diff_area, sector, count,
-			     !!(bio->bi_opf & REQ_NOWAIT));
+	err = tracker_copy(tracker, sector, count,
+			   !!(bio->bi_opf & REQ_NOWAIT));
 
 	current->bio_list = NULL;
 	barrier();
 	memalloc_noio_restore(current_flag);
 
-	if (unlikely(err))
-		goto fail;
-
+	/*
+	 * The bios that have already been created should be submitted even
+	 * if the copying was interrupted. Otherwise, their chunks would
+	 * remain locked.
+	 */
 	while ((new_bio = bio_list_pop(&bio_list_on_stack[0]))) {
 		/*
 		 * The result from submitting a bio from the
@@ -166,6 +219,9 @@ static bool tracker_submit_bio_cb(struct bio *bio,
 		submit_bio_noacct(new_bio);
 #endif
 	}
+	if (unlikely(err))
+		goto fail;
+
 	/*
 	 * If a new bio was created during the handling, then new bios must
 	 * be sent and returned to complete the processing of the original bio.
@@ -173,8 +229,8 @@ static bool tracker_submit_bio_cb(struct bio *bio,
 	 * flags and options.
 	 * Otherwise, write requests confidently overtake read requests.
 	 */
-	err = diff_area_wait(tracker->diff_area, sector, count,
-			     !!(bio->bi_opf & REQ_NOWAIT));
+	err = tracker_wait(tracker, sector, count,
+			   !!(bio->bi_opf & REQ_NOWAIT));
 	if (likely(err == 0))
 		goto out;
 fail:
@@ -332,7 +388,8 @@ static struct tracker *tracker_new(struct block_device *bdev)
 	refcount_inc(&trackers_counter);
 	bdev_filter_init(&tracker->flt, &tracker_fops);
 	INIT_LIST_HEAD(&tracker->link);
-	atomic_set(&tracker->snapshot_is_taken, false);
+	INIT_LIST_HEAD(&tracker->diff_areas);
+	atomic_set(&tracker->snapshot_is_taken, 0);
 	tracker->dev_id = bdev->bd_dev;
 
 	pr_info("Create tracker for device [%u:%u]. Capacity 0x%llx sectors\n",
@@ -367,7 +424,8 @@ fail:
 	return ERR_PTR(ret);
 }
 
-int tracker_take_snapshot(struct tracker *tracker)
+int tracker_take_snapshot(struct tracker *tracker,
+			  struct diff_area *diff_area)
 {
 	int ret = 0;
 	bool cbt_reset_needed = false;
@@ -378,7 +436,7 @@ int tracker_take_snapshot(struct tracker *tracker)
 		pr_warn("Corrupted CBT table detected. CBT fault\n");
 	}
 
-	capacity = bdev_nr_sectors(tracker->diff_area->orig_bdev);
+	capacity = bdev_nr_sectors(diff_area->orig_bdev);
 	if (tracker->cbt_map->device_capacity != capacity) {
 		cbt_reset_needed = true;
 		pr_warn("Device resize detected. CBT fault\n");
@@ -394,20 +452,30 @@ int tracker_take_snapshot(struct tracker *tracker)
 	}
 
 	cbt_map_switch(tracker->cbt_map);
-	atomic_set(&tracker->snapshot_is_taken, true);
+
+	diff_area_get(diff_area);
+	list_add(&diff_area->tracker_link, &tracker->diff_areas);
+	atomic_inc(&tracker->snapshot_is_taken);
 
 	return 0;
 }
 
-void tracker_release_snapshot(struct tracker *tracker)
+void tracker_release_snapshot(struct tracker *tracker,
+			      struct diff_area *diff_area)
 {
-	if (!tracker)
+	if (!tracker || !diff_area)
+		return;
+
+	if (list_empty(&diff_area->tracker_link))
 		return;
 
 	pr_debug("Tracker for device [%u:%u] release snapshot\n",
 		 MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 
-	atomic_set(&tracker->snapshot_is_taken, false);
+	list_del_init(&diff_area->tracker_link);
+	atomic_dec(&tracker->snapshot_is_taken);
+	/* The snapshot still holds the difference area. */
+	diff_area_put(diff_area);
 }
 
 int tracker_init(void)
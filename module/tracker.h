@@ -27,16 +27,22 @@ struct diff_area;
  * @dev_id:
  *	Original block device ID.
  * @snapshot_is_taken:
- *	Indicates that a snapshot was taken for the device whose bios are
- *	handled by this tracker.
+ *	The number of snapshots taken for the device whose bios are handled
+ *	by this tracker.
  * @cbt_map:
  *	Pointer to a change block tracker map.
- * @diff_area:
- *	Pointer to a difference area.
+ * @diff_areas:
+ *	List of the difference areas of the snapshots taken for the device.
+ *	The difference area of the newest snapshot is the first.
  *
  * The main goal of the tracker is to handle bios. The tracker detectes
  * the range of sectors that will change and transmits them to the CBT map
- * and to the difference area.
+ * and to the difference areas.
+ *
+ * Several snapshots of the device can exist at the same time. The data of
+ * a chunk is read from the original device only once and is shared between
+ * all snapshots that need it. The list of the difference areas is changed
+ * only while the trackers are locked.
  */
 struct tracker {
 	struct bdev_filter flt;
@@ -47,7 +53,7 @@ struct tracker {
 	atomic_t snapshot_is_taken;
 
 	struct cbt_map *cbt_map;
-	struct diff_area *diff_area;
+	struct list_head diff_areas;
 };
 
 void tracker_lock(void);
@@ -74,8 +80,10 @@ int tracker_mark_dirty_blocks(dev_t dev_id,
 			      struct blk_snap_block_range *block_ranges,
 			      unsigned int count);
 
-int tracker_take_snapshot(struct tracker *tracker);
-void tracker_release_snapshot(struct tracker *tracker);
+int tracker_take_snapshot(struct tracker *tracker,
+			  struct diff_area *diff_area);
+void tracker_release_snapshot(struct tracker *tracker,
+			      struct diff_area *diff_area);
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
 static inline int _freeze_bdev(struct block_device *bdev,
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <blksnap/Blksnap.h>
+#include <blksnap/Service.h>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "helpers/Log.h"
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+using blksnap::CBlksnap;
+using blksnap::sector_t;
+
+static struct blk_snap_dev DeviceId(const std::string& devName)
+{
+    struct stat st;
+
+    if (::stat(devName.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get device number of [" + devName + "].");
+
+    struct blk_snap_dev dev_id = {.mj = major(st.st_rdev), .mn = minor(st.st_rdev)};
+    return dev_id;
+}
+
+/*
+ * Opens the file and appends it to the difference storage. Returns the errno
+ * of the ioctl.
+ */
+static int AppendFile(CBlksnap& blksnap, const uuid_t& id, const std::string& filename, int flags,
+                      sector_t sectorCount)
+{
+    int fd = ::open(filename.c_str(), flags | O_CREAT | O_LARGEFILE, 0600);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Failed to open file [" + filename + "].");
+
+    int ret = 0;
+    try
+    {
+        blksnap.AppendDiffStorageFile(id, fd, sectorCount);
+    }
+    catch (std::system_error& ex)
+    {
+        ret = ex.code().value();
+    }
+    ::close(fd);
+    return ret;
+}
+
+static void CheckPinned(const std::string& filename)
+{
+    int fd = ::open(filename.c_str(), O_WRONLY | O_LARGEFILE);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Failed to open file [" + filename + "].");
+
+    char data[512] = {0};
+    int ret = (::pwrite(fd, data, sizeof(data), 0) < 0) ? errno : 0;
+    ::close(fd);
+
+    if (ret != ETXTBSY)
+        throw std::runtime_error("Writing to the appended file: expected ETXTBSY, but got " + std::to_string(ret) + ".");
+}
+
+static void CheckAppendFile(const std::string& origDevName, const std::string& storageDir, const std::string& origDir,
+                            const int sizeMb)
+{
+    logger.Info("--- Test: append file ---");
+    logger.Info("version: " + blksnap::Version());
+    logger.Info("device: " + origDevName);
+
+    CBlksnap blksnap;
+    struct blk_snap_mod mod;
+
+    if (!blksnap.Modification(mod) || !(mod.compatibility_flags & (1ull << blk_snap_compat_flag_append_file)))
+    {
+        logger.Info("--- Skipped: appending a file is not supported ---");
+        return;
+    }
+
+    std::vector<struct blk_snap_dev> devices;
+    devices.push_back(DeviceId(origDevName));
+    uuid_t id;
+    sector_t sectorCount = static_cast<sector_t>(sizeMb) << (20 - SECTOR_SHIFT);
+
+    std::vector<std::string> files;
+    fs::path filepath(storageDir);
+    filepath /= std::string("append_file#0");
+    files.push_back(filepath.string());
+    filepath = fs::path(storageDir);
+    filepath /= std::string("append_file#1");
+    files.push_back(filepath.string());
+    if (!origDir.empty())
+    {
+        filepath = fs::path(origDir);
+        filepath /= std::string("append_file#2");
+        files.push_back(filepath.string());
+    }
+    for (const auto& file : files)
+        if (fs::exists(file))
+            fs::remove(file);
+
+    logger.Info("-- Create snapshot");
+    blksnap.Create(devices, id);
+    try
+    {
+        int ret;
+        struct blk_snap_snapshot_storage_stat stat;
+
+        logger.Info("Append the file opened for reading only");
+        ret = AppendFile(blksnap, id, files[0], O_RDONLY, sectorCount);
+        if (ret != EBADF)
+            throw std::runtime_error("Expected EBADF, but got " + std::to_string(ret) + ".");
+
+        logger.Info("Append the file [" + files[0] + "]");
+        ret = AppendFile(blksnap, id, files[0], O_RDWR, sectorCount);
+        if (ret)
+            throw std::system_error(ret, std::generic_category(), "Failed to append file.");
+
+        blksnap.GetStorageStat(id, stat);
+        logger.Info("capacity: " + std::to_string(stat.capacity));
+        if (!stat.capacity || (stat.capacity > sectorCount))
+            throw std::runtime_error("Unexpected capacity of the difference storage.");
+        if (fs::file_size(files[0]) < (sectorCount << SECTOR_SHIFT))
+            throw std::runtime_error("The appended file has not been allocated.");
+
+        logger.Info("Append the same file again");
+        ret = AppendFile(blksnap, id, files[0], O_RDWR, sectorCount);
+        if (ret != ETXTBSY)
+            throw std::runtime_error("Expected ETXTBSY, but got " + std::to_string(ret) + ".");
+
+        logger.Info("-- Take snapshot");
+        blksnap.Take(id);
+
+        logger.Info("Check that the file is pinned");
+        CheckPinned(files[0]);
+
+        logger.Info("Append the file [" + files[1] + "]");
+        sector_t capacity = stat.capacity;
+        ret = AppendFile(blksnap, id, files[1], O_RDWR, sectorCount);
+        if (ret)
+            throw std::system_error(ret, std::generic_category(), "Failed to append file.");
+        blksnap.GetStorageStat(id, stat);
+        logger.Info("capacity: " + std::to_string(stat.capacity));
+        if ((stat.capacity <= capacity) || (stat.capacity > capacity + sectorCount))
+            throw std::runtime_error("Unexpected capacity of the difference storage.");
+
+        if (!origDir.empty())
+        {
+            logger.Info("Append the file located on the original device");
+            ret = AppendFile(blksnap, id, files[2], O_RDWR, sectorCount);
+            if (ret != EBUSY)
+                throw std::runtime_error("Expected EBUSY, but got " + std::to_string(ret) + ".");
+        }
+    }
+    catch (std::exception&)
+    {
+        blksnap.Destroy(id);
+        throw;
+    }
+
+    logger.Info("-- Destroy snapshot");
+    blksnap.Destroy(id);
+
+    for (const auto& file : files)
+        if (fs::exists(file))
+            fs::remove(file);
+
+    logger.Info("--- Success: append file ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the appending of a file to the difference storage of the blksnap module.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>()->default_value("/var/log/blksnap_append_file.log"), "Detailed log of all transactions.")
+        ("device,d", po::value<std::string>(), "Device name.")
+        ("diff_storage,s", po::value<std::string>(), "Directory name for allocating diff storage files. It should not be located on the device.")
+        ("orig_dir,o", po::value<std::string>(), "Directory on the file system of the device. If set, appending a file from it is checked to fail.")
+        ("size", po::value<int>()->default_value(64), "The size of the appended files in MiB.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    logger.Info("Parameters:");
+
+    std::string log = vm["log"].as<std::string>();
+    logger.Info("log: " + log);
+    logger.Open(log);
+
+    if (!vm.count("device"))
+        throw std::invalid_argument("Argument 'device' is missed.");
+    std::string origDevName = vm["device"].as<std::string>();
+    logger.Info("device: " + origDevName);
+
+    if (!vm.count("diff_storage"))
+        throw std::invalid_argument("Argument 'diff_storage' is missed.");
+    std::string diffStorage = vm["diff_storage"].as<std::string>();
+    logger.Info("diff_storage: " + diffStorage);
+
+    std::string origDir;
+    if (vm.count("orig_dir"))
+        origDir = vm["orig_dir"].as<std::string>();
+    logger.Info("orig_dir: " + origDir);
+
+    int sizeMb = vm["size"].as<int>();
+    logger.Info("size: " + std::to_string(sizeMb));
+    if (sizeMb <= 0)
+        throw std::invalid_argument("Argument 'size' should be positive.");
+
+    CheckAppendFile(origDevName, diffStorage, origDir, sizeMb);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
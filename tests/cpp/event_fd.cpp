@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <blksnap/Blksnap.h>
+#include <blksnap/Service.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "helpers/Log.h"
+
+namespace po = boost::program_options;
+using blksnap::CBlksnap;
+using blksnap::SBlksnapEvent;
+
+static struct blk_snap_dev DeviceId(const std::string& devName)
+{
+    struct stat st;
+
+    if (::stat(devName.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get device number of [" + devName + "].");
+
+    struct blk_snap_dev dev_id = {.mj = major(st.st_rdev), .mn = minor(st.st_rdev)};
+    return dev_id;
+}
+
+static short PollEventFd(int eventFd, int timeoutMs)
+{
+    struct pollfd fds = {.fd = eventFd, .events = POLLIN, .revents = 0};
+
+    int ret = ::poll(&fds, 1, timeoutMs);
+    if (ret < 0)
+        throw std::system_error(errno, std::generic_category(), "Failed to poll the event file.");
+    if (ret == 0)
+        throw std::runtime_error("The event file has not become ready in " + std::to_string(timeoutMs) + " ms.");
+
+    return fds.revents;
+}
+
+static void CheckEventFd(const std::string& origDevName)
+{
+    logger.Info("--- Test: event file descriptor ---");
+    logger.Info("version: " + blksnap::Version());
+    logger.Info("device: " + origDevName);
+
+    CBlksnap blksnap;
+    struct blk_snap_mod mod;
+
+    if (!blksnap.Modification(mod) || !(mod.compatibility_flags & (1ull << blk_snap_compat_flag_event_fd)))
+    {
+        logger.Info("--- Skipped: the event file descriptor is not supported ---");
+        return;
+    }
+
+    std::vector<struct blk_snap_dev> devices;
+    devices.push_back(DeviceId(origDevName));
+    uuid_t id;
+
+    /*
+     * The difference storage is empty, so the low free space event is
+     * generated as soon as the snapshot is created.
+     */
+    logger.Info("-- Create snapshot");
+    blksnap.Create(devices, id);
+
+    int eventFd = -1;
+    try
+    {
+        eventFd = blksnap.OpenEventFd(id);
+
+        logger.Info("Wait for the low free space event");
+        if (!(PollEventFd(eventFd, 10000) & POLLIN))
+            throw std::runtime_error("The event file is not readable.");
+
+        SBlksnapEvent ev;
+        if (!CBlksnap::ReadEvent(eventFd, ev))
+            throw std::runtime_error("Failed to read the event.");
+        if (ev.code != blk_snap_event_code_low_free_space)
+            throw std::runtime_error("Unexpected event code " + std::to_string(ev.code) + ".");
+        if (!ev.lowFreeSpace.requestedSectors)
+            throw std::runtime_error("The low free space event requests no sectors.");
+        logger.Info("requested sectors: " + std::to_string(ev.lowFreeSpace.requestedSectors));
+    }
+    catch (std::exception&)
+    {
+        if (eventFd >= 0)
+            ::close(eventFd);
+        blksnap.Destroy(id);
+        throw;
+    }
+
+    logger.Info("-- Destroy snapshot");
+    blksnap.Destroy(id);
+
+    try
+    {
+        logger.Info("Wait for the end of the event file");
+        if (!(PollEventFd(eventFd, 10000) & POLLHUP))
+            throw std::runtime_error("The event file is not hung up after the snapshot is destroyed.");
+
+        struct blk_snap_snapshot_event param;
+        ssize_t ret = ::read(eventFd, &param, sizeof(param));
+        if (ret < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to read the event file.");
+        if (ret != 0)
+            throw std::runtime_error("The end of the event file is expected.");
+    }
+    catch (std::exception&)
+    {
+        ::close(eventFd);
+        throw;
+    }
+    ::close(eventFd);
+
+    logger.Info("--- Success: event file descriptor ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the file descriptor of the snapshot events of the blksnap module.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>()->default_value("/var/log/blksnap_event_fd.log"), "Detailed log of all transactions.")
+        ("device,d", po::value<std::string>(), "Device name.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    logger.Info("Parameters:");
+
+    std::string log = vm["log"].as<std::string>();
+    logger.Info("log: " + log);
+    logger.Open(log);
+
+    if (!vm.count("device"))
+        throw std::invalid_argument("Argument 'device' is missed.");
+    std::string origDevName = vm["device"].as<std::string>();
+    logger.Info("device: " + origDevName);
+
+    CheckEventFd(origDevName);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <blksnap/Blksnap.h>
+#include <blksnap/Service.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
+#include "helpers/RandomHelper.h"
+
+namespace po = boost::program_options;
+using blksnap::CBlksnap;
+using blksnap::SBlksnapEvent;
+using blksnap::sector_t;
+
+static struct blk_snap_dev DeviceId(const std::string& devName)
+{
+    struct stat st;
+
+    if (::stat(devName.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get device number of [" + devName + "].");
+
+    struct blk_snap_dev dev_id = {.mj = major(st.st_rdev), .mn = minor(st.st_rdev)};
+    return dev_id;
+}
+
+static long long ModuleParameter(const std::string& name)
+{
+    std::ifstream file("/sys/module/blksnap/parameters/" + name);
+    long long value;
+
+    if (!(file >> value))
+        throw std::runtime_error("Failed to read the module parameter [" + name + "].");
+    return value;
+}
+
+static void LogStat(const struct blk_snap_snapshot_storage_stat& stat)
+{
+    logger.Info("capacity: " + std::to_string(stat.capacity) + " filled: " + std::to_string(stat.filled) +
+                " requested: " + std::to_string(stat.requested) + " fill rate: " + std::to_string(stat.fill_rate));
+}
+
+static void CheckStorageStat(const std::string& origDevName)
+{
+    logger.Info("--- Test: storage statistics ---");
+    logger.Info("version: " + blksnap::Version());
+    logger.Info("device: " + origDevName);
+
+    CBlksnap blksnap;
+    struct blk_snap_mod mod;
+
+    if (!blksnap.Modification(mod) || !(mod.compatibility_flags & (1ull << blk_snap_compat_flag_storage_stat)))
+    {
+        logger.Info("--- Skipped: the storage statistics are not supported ---");
+        return;
+    }
+
+    sector_t minimum = ModuleParameter("diff_storage_minimum");
+    logger.Info("diff_storage_minimum: " + std::to_string(minimum));
+    logger.Info("diff_storage_horizon: " + std::to_string(ModuleParameter("diff_storage_horizon")));
+
+    auto ptrOrininal = std::make_shared<CBlockDevice>(origDevName);
+    sector_t deviceSize = ptrOrininal->Size() >> SECTOR_SHIFT;
+    sector_t pageSectors = getpagesize() >> SECTOR_SHIFT;
+    logger.Info("device size: " + std::to_string(ptrOrininal->Size()));
+
+    struct blk_snap_dev dev_id = DeviceId(origDevName);
+    std::vector<struct blk_snap_dev> devices;
+    devices.push_back(dev_id);
+    uuid_t id;
+
+    /*
+     * The second half of the device is the difference storage. The data
+     * is written to the first half only.
+     */
+    sector_t half = (deviceSize / 2) & ~(pageSectors - 1);
+    std::vector<struct blk_snap_block_range> ranges;
+    ranges.push_back({.sector_offset = half, .sector_count = half});
+
+    logger.Info("-- Create snapshot");
+    blksnap.Create(devices, id);
+    try
+    {
+        struct blk_snap_snapshot_storage_stat stat;
+        struct blk_snap_snapshot_storage_stat next;
+        SBlksnapEvent ev;
+
+        /*
+         * The difference storage is empty, so the low free space event is
+         * generated as soon as the snapshot is created.
+         */
+        logger.Info("Wait for the low free space event");
+        if (!blksnap.WaitEvent(id, 10000, ev))
+            throw std::runtime_error("The low free space event has not been received.");
+        if (ev.code != blk_snap_event_code_low_free_space)
+            throw std::runtime_error("Unexpected event code " + std::to_string(ev.code) + ".");
+        logger.Info("requested sectors: " + std::to_string(ev.lowFreeSpace.requestedSectors));
+        if (ev.lowFreeSpace.requestedSectors < minimum)
+            throw std::runtime_error("The event requests less than diff_storage_minimum.");
+
+        blksnap.GetStorageStat(id, stat);
+        LogStat(stat);
+        if (stat.capacity || stat.filled)
+            throw std::runtime_error("The empty difference storage has capacity or filled sectors.");
+        if (stat.requested != ev.lowFreeSpace.requestedSectors)
+            throw std::runtime_error("The requested sectors differ from the ones requested by the event.");
+
+        logger.Info("Append the difference storage");
+        blksnap.AppendDiffStorage(id, dev_id, ranges);
+        blksnap.GetStorageStat(id, stat);
+        LogStat(stat);
+        if (stat.capacity != half)
+            throw std::runtime_error("The capacity differs from the appended sectors.");
+        if (stat.requested != ev.lowFreeSpace.requestedSectors)
+            throw std::runtime_error("The requested sectors have been changed by appending.");
+
+        logger.Info("-- Take snapshot");
+        blksnap.Take(id);
+
+        logger.Info("Write test data");
+        AlignedBuffer<unsigned char> portion(getpagesize(), 64 * 1024);
+        for (int inx = 0; inx < 100; inx++)
+        {
+            off_t offset = (static_cast<sector_t>(CRandomHelper::GenerateInt()) % half) & ~(pageSectors - 1);
+
+            CRandomHelper::GenerateBuffer(portion.Data(), portion.Size());
+            ptrOrininal->Write(portion.Data(), portion.Size(), offset << SECTOR_SHIFT);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        blksnap.GetStorageStat(id, stat);
+        LogStat(stat);
+        if (!stat.filled)
+            throw std::runtime_error("No sectors have been filled in.");
+        if (stat.filled > stat.capacity)
+            throw std::runtime_error("More sectors are filled than appended.");
+        if (stat.requested < ev.lowFreeSpace.requestedSectors)
+            throw std::runtime_error("The requested sectors have been decreased.");
+
+        /*
+         * When nothing is written, the request for the statistics should
+         * not change them, and in particular it should not change the fill
+         * rate. The chunks that are still being stored can change them, so
+         * the statistics are requested until they remain the same.
+         */
+        logger.Info("Wait for the statistics to stop changing");
+        bool isStable = false;
+        for (int inx = 0; !isStable && (inx < 20); inx++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            blksnap.GetStorageStat(id, next);
+            LogStat(next);
+            isStable = (next.capacity == stat.capacity) && (next.filled == stat.filled) &&
+                       (next.requested == stat.requested) && (next.fill_rate == stat.fill_rate);
+            stat = next;
+        }
+        if (!isStable)
+            throw std::runtime_error("The statistics keep changing without writing.");
+    }
+    catch (std::exception&)
+    {
+        blksnap.Destroy(id);
+        throw;
+    }
+    logger.Info("-- Destroy snapshot");
+    blksnap.Destroy(id);
+
+    logger.Info("--- Success: storage statistics ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the statistics of the difference storage reported by the blksnap module.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>()->default_value("/var/log/blksnap_storage_stat.log"), "Detailed log of all transactions.")
+        ("device,d", po::value<std::string>(), "Device name. Its data is overwritten.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    logger.Info("Parameters:");
+
+    std::string log = vm["log"].as<std::string>();
+    logger.Info("log: " + log);
+    logger.Open(log);
+
+    if (!vm.count("device"))
+        throw std::invalid_argument("Argument 'device' is missed.");
+    std::string origDevName = vm["device"].as<std::string>();
+    logger.Info("device: " + origDevName);
+
+    CheckStorageStat(origDevName);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <blksnap/Blksnap.h>
+#include <blksnap/Service.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
+#include "helpers/RandomHelper.h"
+
+namespace po = boost::program_options;
+using blksnap::CBlksnap;
+using blksnap::sector_t;
+
+static struct blk_snap_dev DeviceId(const std::string& devName)
+{
+    struct stat st;
+
+    if (::stat(devName.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get device number of [" + devName + "].");
+
+    struct blk_snap_dev dev_id = {.mj = major(st.st_rdev), .mn = minor(st.st_rdev)};
+    return dev_id;
+}
+
+/*
+ * Calls the ioctl directly, since the library hides the retries on ENODATA.
+ */
+static int StorageUsageIoctl(const uuid_t& id, struct blk_snap_snapshot_storage_usage& param)
+{
+    int fd = ::open(BLK_SNAP_CTL, O_RDWR);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), BLK_SNAP_CTL);
+
+    uuid_copy(param.id.b, id);
+    int ret = ::ioctl(fd, IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_USAGE, &param) ? errno : 0;
+
+    ::close(fd);
+    return ret;
+}
+
+static void CheckResizePath(const uuid_t& id)
+{
+    struct blk_snap_snapshot_storage_usage param = {0};
+    int ret;
+
+    logger.Info("Request the number of elements");
+    ret = StorageUsageIoctl(id, param);
+    if (ret)
+        throw std::system_error(ret, std::generic_category(), "Failed to get the number of elements.");
+    if (!param.storage_dev_count || !param.orig_dev_count)
+        throw std::runtime_error("The number of elements is zero.");
+
+    unsigned int storageDevCount = param.storage_dev_count;
+    unsigned int origDevCount = param.orig_dev_count;
+    logger.Info("storage devices: " + std::to_string(storageDevCount) +
+                " original devices: " + std::to_string(origDevCount));
+
+    logger.Info("Request with the arrays that are too small");
+    std::vector<struct blk_snap_storage_dev_usage> storageDevices(storageDevCount);
+    std::vector<struct blk_snap_orig_dev_usage> originalDevices(origDevCount);
+
+    param.storage_dev_count = storageDevCount - 1;
+    param.storage_dev_array = storageDevices.data();
+    param.orig_dev_count = origDevCount - 1;
+    param.orig_dev_array = originalDevices.data();
+    ret = StorageUsageIoctl(id, param);
+    if (ret != ENODATA)
+        throw std::runtime_error("Expected ENODATA, but got " + std::to_string(ret) + ".");
+    if ((param.storage_dev_count != storageDevCount) || (param.orig_dev_count != origDevCount))
+        throw std::runtime_error("The required number of elements was not returned.");
+
+    logger.Info("Request with the arrays of the required size");
+    ret = StorageUsageIoctl(id, param);
+    if (ret)
+        throw std::system_error(ret, std::generic_category(), "Failed to get the usage.");
+}
+
+static void CheckTotals(CBlksnap& blksnap, const uuid_t& id)
+{
+    struct blk_snap_snapshot_storage_usage usage;
+    std::vector<struct blk_snap_storage_dev_usage> storageDevices;
+    std::vector<struct blk_snap_orig_dev_usage> originalDevices;
+
+    blksnap.GetStorageUsage(id, usage, storageDevices, originalDevices);
+
+    logger.Info("capacity: " + std::to_string(usage.capacity) + " filled: " + std::to_string(usage.filled) +
+                " requested: " + std::to_string(usage.requested) + " wasted: " + std::to_string(usage.wasted) +
+                " regions: " + std::to_string(usage.region_count));
+
+    __u64 capacity = 0;
+    __u64 filled = 0;
+    __u64 wasted = 0;
+    for (const auto& dev : storageDevices)
+    {
+        logger.Info("storage device " + std::to_string(dev.dev_id.mj) + ":" + std::to_string(dev.dev_id.mn) +
+                    " capacity: " + std::to_string(dev.capacity) + " filled: " + std::to_string(dev.filled) +
+                    " wasted: " + std::to_string(dev.wasted));
+        capacity += dev.capacity;
+        filled += dev.filled;
+        wasted += dev.wasted;
+    }
+
+    __u64 stored = 0;
+    __u64 regionCount = 0;
+    for (const auto& dev : originalDevices)
+    {
+        logger.Info("original device " + std::to_string(dev.dev_id.mj) + ":" + std::to_string(dev.dev_id.mn) +
+                    " stored: " + std::to_string(dev.stored) + " regions: " + std::to_string(dev.region_count));
+        stored += dev.stored;
+        regionCount += dev.region_count;
+    }
+
+    if (capacity != usage.capacity)
+        throw std::runtime_error("The capacity differs from the sum over the storage devices.");
+    if (filled != usage.filled)
+        throw std::runtime_error("The filled sectors differ from the sum over the storage devices.");
+    if (wasted != usage.wasted)
+        throw std::runtime_error("The wasted sectors differ from the sum over the storage devices.");
+    if (regionCount != usage.region_count)
+        throw std::runtime_error("The number of regions differs from the sum over the original devices.");
+    if (usage.filled > usage.capacity)
+        throw std::runtime_error("More sectors are filled than appended.");
+    if (stored + usage.wasted > usage.filled)
+        throw std::runtime_error("More sectors are stored than filled.");
+}
+
+static void CheckStorageUsage(const std::string& origDevName)
+{
+    logger.Info("--- Test: storage usage ---");
+    logger.Info("version: " + blksnap::Version());
+    logger.Info("device: " + origDevName);
+
+    auto ptrOrininal = std::make_shared<CBlockDevice>(origDevName);
+    sector_t deviceSize = ptrOrininal->Size() >> SECTOR_SHIFT;
+    sector_t pageSectors = getpagesize() >> SECTOR_SHIFT;
+    logger.Info("device size: " + std::to_string(ptrOrininal->Size()));
+
+    CBlksnap blksnap;
+    struct blk_snap_dev dev_id = DeviceId(origDevName);
+    std::vector<struct blk_snap_dev> devices;
+    devices.push_back(dev_id);
+    uuid_t id;
+
+    /*
+     * The second half of the device is the difference storage. The data
+     * is written to the first half only.
+     */
+    sector_t quarter = (deviceSize / 4) & ~(pageSectors - 1);
+    std::vector<struct blk_snap_block_range> ranges;
+    ranges.push_back({.sector_offset = 2 * quarter, .sector_count = quarter});
+    ranges.push_back({.sector_offset = 3 * quarter, .sector_count = quarter});
+
+    logger.Info("-- Create snapshot");
+    blksnap.Create(devices, id);
+    try
+    {
+        blksnap.AppendDiffStorage(id, dev_id, ranges);
+        blksnap.Take(id);
+
+        logger.Info("Write test data");
+        AlignedBuffer<unsigned char> portion(getpagesize(), 64 * 1024);
+        for (int inx = 0; inx < 100; inx++)
+        {
+            off_t offset = (static_cast<sector_t>(CRandomHelper::GenerateInt()) % (2 * quarter)) & ~(pageSectors - 1);
+
+            CRandomHelper::GenerateBuffer(portion.Data(), portion.Size());
+            ptrOrininal->Write(portion.Data(), portion.Size(), offset << SECTOR_SHIFT);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        CheckResizePath(id);
+        CheckTotals(blksnap, id);
+    }
+    catch (std::exception& ex)
+    {
+        blksnap.Destroy(id);
+        throw;
+    }
+    logger.Info("-- Destroy snapshot");
+    blksnap.Destroy(id);
+
+    logger.Info("--- Success: storage usage ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the usage of the difference storage reported by the blksnap module.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>()->default_value("/var/log/blksnap_storage_usage.log"), "Detailed log of all transactions.")
+        ("device,d", po::value<std::string>(), "Device name. Its data is overwritten.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    logger.Info("Parameters:");
+
+    std::string log = vm["log"].as<std::string>();
+    logger.Info("log: " + log);
+    logger.Open(log);
+
+    if (!vm.count("device"))
+        throw std::invalid_argument("Argument 'device' is missed.");
+    std::string origDevName = vm["device"].as<std::string>();
+    logger.Info("device: " + origDevName);
+
+    CheckStorageUsage(origDevName);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
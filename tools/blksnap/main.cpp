@@ -978,6 +978,77 @@ public:
             throw std::system_error(errno, std::generic_category(), "Failed to set logging.");
     };
 };
+
+class SnapshotAppendFileArgsProc : public IArgsProc
+{
+public:
+    SnapshotAppendFileArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Append file to difference storage for snapshot. The module allocates the file and pins it while the snapshot exists.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("file,f", po::value<std::string>(), "File for diff storage. It's created if it does not exist.")
+          ("size,s", po::value<unsigned int>(), "Size of the file in MiB.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_append_file param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("file"))
+            throw std::invalid_argument("Argument 'file' is missed.");
+        if (!vm.count("size"))
+            throw std::invalid_argument("Argument 'size' is missed.");
+        param.sector_count = static_cast<__u64>(vm["size"].as<unsigned int>()) << (20 - SECTOR_SHIFT);
+
+        std::string filename = vm["file"].as<std::string>();
+        param.fd = ::open(filename.c_str(), O_CREAT | O_RDWR | O_LARGEFILE, 0600);
+        if (param.fd < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to open file for diff storage.");
+
+        int ret = ::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_APPEND_FILE, &param);
+        int err = errno;
+        ::close(param.fd);
+        if (ret)
+            throw std::system_error(err, std::generic_category(), "Failed to append file to diff storage for snapshot.");
+    };
+};
+
+class SnapshotStorageStatArgsProc : public IArgsProc
+{
+public:
+    SnapshotStorageStatArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Print difference storage statistics for snapshot.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_storage_stat param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_STAT, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to get diff storage statistics.");
+
+        std::cout << "capacity=" << param.capacity << std::endl;
+        std::cout << "filled=" << param.filled << std::endl;
+        std::cout << "requested=" << param.requested << std::endl;
+        std::cout << "fill_rate=" << param.fill_rate << std::endl;
+    };
+};
 #endif
 
 static std::map<std::string, std::shared_ptr<IArgsProc>> argsProcMap{
@@ -995,6 +1066,8 @@ static std::map<std::string, std::shared_ptr<IArgsProc>> argsProcMap{
   {"stretch_snapshot", std::make_shared<StretchSnapshotArgsProc>()},
 #ifdef BLK_SNAP_MODIFICATION
   {"setlog", std::make_shared<SetlogArgsProc>()},
+  {"snapshot_appendfile", std::make_shared<SnapshotAppendFileArgsProc>()},
+  {"snapshot_storagestat", std::make_shared<SnapshotStorageStatArgsProc>()},
 #endif
 };
 